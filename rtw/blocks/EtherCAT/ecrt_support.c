@@ -12,27 +12,86 @@
  *        and ecs_send() to write new values to the EtherCAT terminals.
  *      - When finished, call ecs_end()
  *
+ * Options, e.g. from the command line of the application, are set using
+ * ecs_set_option() before ecs_init(). ecs_register_statistics() exports
+ * the timing statistics of the support layer to PdServ.
+ *
  * See the individual functions for more details.
  * */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* CPU_SET(), pthread_attr_setaffinity_np() */
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <time.h>
 #include <endian.h>
 #include <string.h>
+#include <stdlib.h>
+#include <byteswap.h>
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pdserv.h>
 #include "ecrt_support.h"
 
 extern pthread_key_t monotonic_time_key;
 
 #if MT
-#include <semaphore.h>
 extern pthread_key_t tid_key;
 #endif
 
 #define ETL_TIMESPEC2NANO(TV) ((TV).tv_sec * 1000000000ULL + (TV).tv_nsec)
 
+/* Set ECS_CONVERT_PLAN to 0 to disable the conversion plan compiler.
+ * All PDO entries are then converted using one function call per entry */
+#ifndef ECS_CONVERT_PLAN
+#define ECS_CONVERT_PLAN 1
+#endif
+
+/* The outdated ASYNC_ECAT sent the outputs in the output section of the
+ * model. It now selects the pipelined I/O mode as default */
+#ifdef ASYNC_ECAT
+#define ECS_IO_DEFAULT ECS_IO_PIPELINED
+#else
+#define ECS_IO_DEFAULT ECS_IO_SYNC
+#endif
+
+/* Time before the release of the outputs that is busy waited instead of
+ * slept, in ns. See the option "release" */
+#ifndef ECS_RELEASE_SPIN
+#define ECS_RELEASE_SPIN 20000
+#endif
+
+/* Default safety margin added to the SYNC0 shift time by the calibration
+ * in ns. See the option "calibrate" */
+#ifndef ECS_CALIBRATE_MARGIN
+#define ECS_CALIBRATE_MARGIN 10000
+#endif
+
+/* Bus clock mode: gains of the PI controller steering the wakeup of the
+ * tasks to the reference clock, and the limit of its output in ppm of the
+ * period. See the option "bus-clock" */
+#ifndef ECS_PLL_KP
+#define ECS_PLL_KP 0.1
+#endif
+#ifndef ECS_PLL_KI
+#define ECS_PLL_KI 0.005
+#endif
+#ifndef ECS_PLL_LIMIT
+#define ECS_PLL_LIMIT 1000
+#endif
+
+/* Number of masters for which timing statistics and options are kept */
+#ifndef ECS_MAX_MASTERS
+#define ECS_MAX_MASTERS 8
+#endif
+
 /* The following message gets repeated quite frequently. */
 const char *no_mem_msg = "Could not allocate memory";
 char errbuf[256];
@@ -113,6 +172,7 @@ struct ec_slave_sdo {
     unsigned int position;
     unsigned int len;
     void **addr;
+    ec_sdo_request_t *request;  /* Kept for a restart of the model */
 };
 struct list_head ec_slave_sdo_head = {&ec_slave_sdo_head, &ec_slave_sdo_head};
 
@@ -122,6 +182,33 @@ struct endian_convert_t {
     void *dst;
     const void *src;
     size_t index;
+    const struct pdo_map *map;  /* Only set for scaled entries */
+};
+
+/* Operations of a conversion plan */
+enum plan_op {
+    PLAN_END = 0,
+    PLAN_COPY,          /* memcpy() a block of native endian entries */
+    PLAN_SWAP16,        /* Byte swap a run of 16 bit entries */
+    PLAN_SWAP32,        /* Byte swap a run of 32 bit entries */
+    PLAN_SWAP64,        /* Byte swap a run of 64 bit entries */
+    PLAN_UNPACK,        /* Unpack a run of adjacent 1 bit input entries */
+    PLAN_PACK,          /* Pack a run of adjacent 1 bit output entries */
+    PLAN_SCALE_IN,      /* Convert and scale a run of analog inputs */
+    PLAN_SCALE_OUT,     /* Scale and convert a run of analog outputs */
+    PLAN_CALL,          /* Call conversion function of a run of entries */
+};
+
+/* A step in the conversion plan operates on a run of list entries.
+ * For PLAN_COPY, count is 1 and list->index holds the block length.
+ * For PLAN_UNPACK and PLAN_PACK, count is the number of bits and only
+ * the first list entry is used.
+ * For PLAN_SCALE_IN and PLAN_SCALE_OUT, list->index of the first entry
+ * is set if all entries of the run share the same gain and offset */
+struct plan_step {
+    enum plan_op op;
+    size_t count;
+    const struct endian_convert_t *list;
 };
 
 /** EtherCAT domain.
@@ -131,9 +218,9 @@ struct endian_convert_t {
  */
 struct ecat_domain {
     struct list_head list;      /* Linked list of domains. This list
-                                 * is only used prior to ecs_start(), where
-                                 * it is reworked into an array for faster
-                                 * access */
+                                 * is only used prior to ecs_start_slaves(),
+                                 * where it is reworked into the dispatch
+                                 * tables for faster access */
 
     char input;                 /* Input domain (TxPdo's) */
     char output;                /* Output domain (RxPdo's) */
@@ -156,7 +243,16 @@ struct ecat_domain {
     struct endian_convert_t *input_convert_list;
     struct endian_convert_t *output_convert_list;
 
+    /* Conversion plans compiled from the lists above. If NULL, the
+     * lists are used directly */
+    struct plan_step *input_plan;
+    struct plan_step *output_plan;
+
     uint8_t *io_data;              /* IO data is located here */
+
+#if MT
+    int io_state;               /* enum domain_io, see below */
+#endif
 };
 
 /** EtherCAT master.
@@ -165,9 +261,9 @@ struct ecat_domain {
  */
 struct ecat_master {
     struct list_head list;      /* Linked list of masters. This list
-                                 * is only used prior to ecs_start(), where
-                                 * it is reworked into an array for faster
-                                 * access */
+                                 * is only used prior to ecs_start_slaves(),
+                                 * where it is reworked into the dispatch
+                                 * tables for faster access */
 
     unsigned int fastest_tid;   /* Fastest RTW task id that uses this
                                  * master */
@@ -179,15 +275,158 @@ struct ecat_master {
     ec_master_t *handle;        /* Handle retured by EtherCAT code */
     ec_master_state_t state;    /* Pointer for master's state */
 
+    unsigned int io_mode;       /* enum ecs_io_mode */
+
+    /* SYNC0 shift time calibration, see ecs_set_option(). Only the
+     * owner of the master touches this during cyclic operation */
+    struct {
+        unsigned int cycles;    /* Cycles left to measure */
+        unsigned int count;     /* Cycles measured */
+        unsigned int lost;      /* Frames that did not return in time */
+        uint64_t send_sum;      /* Wakeup until sent in ns */
+        uint64_t send_max;
+        uint64_t round_trip_sum;        /* Sent until returned in ns */
+        uint64_t round_trip_max;
+    } calib;
+
+    /* Bus clock mode, only used by the owner of the master */
+    struct {
+        uint32_t ref_time;      /* Reference clock at the previous sample */
+        unsigned int cycles;    /* Cycles since then, 0: no sample yet */
+        unsigned int period;    /* in ns */
+        double phase;           /* Phase error in ns */
+        double integral;        /* Integral part of the output in ns */
+    } pll;
+
     unsigned int refclk_trigger_init; /* Decimation for reference clock
                                          == 0 => do not use dc */
     unsigned int refclk_trigger; /* When == 1, trigger a time syncronisation */
 
+    struct list_head domain_list;
+};
+
+/** Domain I/O hand over.
+ *
+ * With MT, all ecrt_*() calls of a master are made by the fastest task
+ * using that master (the owner), so that no locking is required.
+ * Slower tasks only convert the domain data and hand over the domain
+ * to the owner using the domain's io_state:
+ *
+ *   IDLE  -> QUEUE    task: outputs converted, domain has to be queued
+ *   QUEUE -> SENT     owner: ecrt_domain_queue() called
+ *   SENT  -> READY    owner: ecrt_domain_process() called
+ *   READY -> IDLE     task: inputs converted
+ *
+ * Only the side whose turn it is touches the domain data.
+ */
+enum domain_io {
+    DOMAIN_IO_IDLE = 0,
+    DOMAIN_IO_QUEUE,
+    DOMAIN_IO_SENT,
+    DOMAIN_IO_READY,
+};
+
+/* Role of a task regarding a domain in the dispatch table */
+enum domain_mode {
+    DOMAIN_LOCAL = 0,   /* Task owns the master and the domain */
+    DOMAIN_REMOTE,      /* Task owns the domain, but not the master */
+    DOMAIN_PROXY,       /* Task owns the master, calls ecrt_domain_*()
+                         * for a remote domain of another task */
+};
+
+/** Dispatch tables.
+ *
+ * At ecs_start_slaves(), the master and domain lists are reworked into
+ * one table per RTW task, holding only the masters and domains that the
+ * task has to service. ecs_receive() and ecs_send() walk the contiguous
+ * table of their task instead of the lists.
+ *
+ * Without MT, everything is done by task 0 and the decimation counters
+ * are kept in the table.
+ */
+struct task_domain {
+    ec_domain_t *handle;
+    ec_domain_state_t *state;
+
+    /* Conversion plans and lists. The lists are NULL if the domain
+     * has no inputs or outputs respectively */
+    const struct plan_step *input_plan;
+    const struct plan_step *output_plan;
+    const struct endian_convert_t *input_list;
+    const struct endian_convert_t *output_list;
+
 #if MT
-    sem_t lock;
+    enum domain_mode mode;
+    int *io_state;
+#else
+    unsigned int tid;
+    unsigned int tid_trigger;
 #endif
+};
 
-    struct list_head domain_list;
+struct task_master {
+    ec_master_t *handle;
+    struct ecat_master *master;
+
+    char owner;                 /* Task calls ecrt_master_receive() and
+                                 * ecrt_master_send() for this master */
+    int stats;                  /* Index into ecat_stats, -1 if none */
+    unsigned int io_mode;       /* enum ecs_io_mode */
+
+    /* Turnaround mode: domain polled for the return of the frames, and
+     * the time to wait for it in ns */
+    struct task_domain *poll;
+    uint64_t deadline;
+
+    /* Synchronous mode: time after the wakeup of the task when the
+     * outputs are released in ns, 0 to send at once */
+    uint64_t release;
+
+    char bus_clock;             /* Steer the tasks to the reference clock */
+#if MT
+    uint64_t timeout;           /* Maximum time to wait for the owner to
+                                 * hand over a remote domain, in ns */
+#else
+    unsigned int fastest_tid;
+    unsigned int tid_trigger;
+#endif
+
+    /* Domains of this master serviced by the task */
+    struct task_domain *domain;
+    struct task_domain *domain_end;
+};
+
+struct ecat_task {
+    struct task_master *master;
+    struct task_master *master_end;
+
+    uint64_t io_time;           /* ecs_receive() + ecs_send() in the last
+                                 * cycle in ns, see ecs_io_time() */
+};
+
+/** Per-master I/O worker threads.
+ *
+ * With the option "workers", every master in the table of task 0 is
+ * serviced by a thread of its own, so that the masters of a multi-master
+ * installation are received, processed and sent in parallel.
+ * ecs_receive() and ecs_send() of task 0 release all workers at once and
+ * wait on a spin barrier until every worker has finished its master.
+ *
+ * The workers are created by ecs_start_slaves(), outside the cyclic path,
+ * with the SCHED_FIFO priority of the option "worker-priority". They spin
+ * on the release word, so that a release does not cost the wakeup of a
+ * thread. Their CPUs should not be used for anything else, see
+ * worker_main().
+ */
+enum worker_job {
+    WORKER_RECEIVE = 1,
+    WORKER_SEND,
+    WORKER_EXIT,
+};
+
+struct ecat_worker {
+    pthread_t thread;
+    struct task_master *master;
 };
 
 /** EtherCAT support layer.
@@ -200,14 +439,74 @@ static struct ecat_data {
     unsigned int single_tasking;
 
     /* This list is used to store all masters during the registration
-     * process. Thereafter this list is reworked in ecs_start(), moving
-     * the masters and domains into the st[] struct below */
+     * process. Thereafter this list is reworked in ecs_start_slaves(),
+     * moving the masters and domains into the task[] tables below */
     struct list_head master_list;
 
+    /* Dispatch table for every task, see struct ecat_task */
+    struct ecat_task *task;
+
+    /* Worker threads of task 0, see struct ecat_worker. The workers
+     * service the first (worker_end - worker) masters of the table */
+    unsigned int workers;       /* Option "workers" is set */
+    int worker_cpu[ECS_MAX_MASTERS];    /* CPU by master id */
+    unsigned int worker_cpu_count;
+    int worker_priority;        /* SCHED_FIFO, 0: inherited */
+    struct ecat_worker *worker;
+    struct ecat_worker *worker_end;
+    int worker_seq;             /* Incremented to release the workers */
+    int worker_job;             /* enum worker_job */
+    int worker_done;            /* Number of workers done with the job */
+    void *worker_time;          /* monotonic_time_key of task 0 */
+
+    /* I/O mode options by master id: enum ecs_io_mode + 1, 0 if not set */
+    unsigned char io_mode[ECS_MAX_MASTERS];
+    unsigned int turnaround_deadline;   /* in ns, 0: half the period */
+    unsigned int release;               /* in ns, see task_master */
+
+    /* SYNC0 shift time calibration */
+    unsigned int calibrate;             /* Cycles to measure, 0: off */
+    unsigned int calibrate_margin;      /* in ns */
+
+    /* Bus clock mode: master id + 1, 0: off. The controller adds its
+     * output to clock_offset, see ecs_clock_offset() */
+    unsigned int bus_clock;
+    int64_t clock_offset;               /* in ns */
+
+    /* The masters are activated. They stay so when the model is
+     * restarted, see ecs_start_slaves() */
+    unsigned int active;
+
 } ecat_data = {
     .master_list = {&ecat_data.master_list, &ecat_data.master_list},
+    .calibrate_margin = ECS_CALIBRATE_MARGIN,
 };
 
+/** Timing statistics.
+ *
+ * Exported to PdServ using ecs_register_statistics(). Every statistic is
+ * a vector indexed by the master id. Times are in seconds.
+ */
+static struct ecat_stats {
+    double receive_time[ECS_MAX_MASTERS];  /* ecrt_master_receive() until
+                                            * the inputs are converted */
+    double send_time[ECS_MAX_MASTERS];     /* Converting the outputs until
+                                            * ecrt_master_send() returned */
+    double send_offset[ECS_MAX_MASTERS];   /* Task wakeup until
+                                            * ecrt_master_send() returned */
+    double send_jitter[ECS_MAX_MASTERS];   /* Change of send_offset since
+                                            * the previous send */
+    double round_trip[ECS_MAX_MASTERS];    /* Turnaround mode: send until
+                                            * the frames returned */
+    double poll_count[ECS_MAX_MASTERS];    /* Turnaround mode: calls to
+                                            * ecrt_master_receive() */
+    double release_overruns[ECS_MAX_MASTERS]; /* Outputs ready after the
+                                               * release time */
+    double shift_time[ECS_MAX_MASTERS];    /* Result of the calibration */
+    double phase_error[ECS_MAX_MASTERS];   /* Bus clock mode */
+    double clock_correction[ECS_MAX_MASTERS];
+} ecat_stats;
+
 /////////////////////////////////////////////////
 
 /** Read non-aligned data types.
@@ -683,233 +982,1699 @@ ecs_read_be_double(const struct endian_convert_t *c)
     *(uint64_t*)c->dst = be64toh(*(const uint64_t*)c->src);
 }
 
+/*****************************************************************/
 /*****************************************************************/
 
-/* Do input processing for a RTW task.
+/** Bit unpacking and packing.
  *
- * It does the following:
- *  - calls ecrt_master_receive() for every master whose fastest domain is in
- *    this task.
- *  - calls ecrt_domain_process() for every domain in this task
+ * Runs of adjacent 1 bit PDO entries (Boolean) that map to adjacent
+ * boolean_T model elements are converted a whole domain byte at a time:
+ * 8 bits are spread into 8 bytes on input and gathered from 8 bytes on
+ * output. Every output byte of the run is written exactly once.
+ *
+ * The default kernels use SWAR (multiplication) tricks that work on any
+ * 64 bit little endian CPU. On x86, BMI2 pdep/pext is used instead when
+ * the CPU supports it, as detected at runtime.
  */
-void
-ecs_receive(void)
+
+#define BYTE_LSB_MASK 0x0101010101010101ULL
+
+static void
+unpack_bits_swar(uint8_t *dst, const uint8_t *src, size_t n)
 {
-    struct ecat_master *master;
-    struct ecat_domain *domain;
-    struct endian_convert_t *conversion_list;
-    int trigger;
-    unsigned int tid = 0;
+    uint64_t val;
+
+    for (; n; n--, dst += 8) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        /* Replicate the byte, isolate bit i in byte i and
+         * move it to the lowest bit */
+        val = (*src++ * BYTE_LSB_MASK) & 0x8040201008040201ULL;
+        val = ((val + 0x7F7F7F7F7F7F7F7FULL) >> 7) & BYTE_LSB_MASK;
+#else
+        unsigned int i;
+        uint8_t *p = (uint8_t*)&val;
 
-#if MT
-    tid = *(unsigned int*)pthread_getspecific(tid_key);
+        for (i = 0; i < 8; i++)
+            p[i] = (*src >> i) & 1U;
+        src++;
 #endif
+        memcpy(dst, &val, 8);
+    }
+}
 
-    if (!tid && !ETL_is_major_step())
-        return;
-
-    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+static void
+pack_bits_swar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    uint64_t val;
 
-#if MT
-        sem_wait(&master->lock);
-        trigger = master->fastest_tid == tid;
+    for (; n; n--, src += 8) {
+        memcpy(&val, src, 8);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        *dst++ = ((val & BYTE_LSB_MASK) * 0x0102040810204080ULL) >> 56;
 #else
-        trigger = !--master->tid_trigger;
+        {
+            unsigned int i;
+            uint8_t byte = 0;
+
+            for (i = 0; i < 8; i++)
+                byte |= (src[i] & 1U) << i;
+            *dst++ = byte;
+        }
 #endif
+    }
+}
 
-        if (trigger) {
-#ifdef EC_HAVE_SYNC_TO
-            struct timespec *monotonic_time =
-                (struct timespec *) pthread_getspecific(monotonic_time_key);
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
 
-            ecrt_master_application_time(master->handle,
-                    ETL_TIMESPEC2NANO(*monotonic_time));
-#endif
-            ecrt_master_receive(master->handle);
-            ecrt_master_state(master->handle, &master->state);
+__attribute__((target("bmi2")))
+static void
+unpack_bits_bmi2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    uint64_t val;
 
-#ifdef DEBUG_IO
-            pr_debug("%s master(%i)\n", __func__, master->fastest_tid);
-#endif
-        }
+    for (; n; n--, dst += 8) {
+        val = _pdep_u64(*src++, BYTE_LSB_MASK);
+        memcpy(dst, &val, 8);
+    }
+}
 
-        list_for_each(domain, &master->domain_list, struct ecat_domain) {
+__attribute__((target("bmi2")))
+static void
+pack_bits_bmi2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    uint64_t val;
 
-#if MT
-            trigger = domain->tid != tid;
-#else
-            trigger = --domain->tid_trigger;
+    for (; n; n--, src += 8) {
+        memcpy(&val, src, 8);
+        *dst++ = _pext_u64(val, BYTE_LSB_MASK);
+    }
+}
 #endif
-            if (trigger)
-                continue;
 
-            ecrt_domain_process(domain->handle);
-            ecrt_domain_state(domain->handle, &domain->state);
+static void (*unpack_bits)(uint8_t *dst, const uint8_t *src, size_t n)
+    = unpack_bits_swar;
+static void (*pack_bits)(uint8_t *dst, const uint8_t *src, size_t n)
+    = pack_bits_swar;
 
-#ifdef DEBUG_IO
-            pr_debug("%s domain(%i)\n", __func__, domain->tid);
+/*****************************************************************/
+
+static void
+select_bit_kernels(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        unpack_bits = unpack_bits_bmi2;
+        pack_bits = pack_bits_bmi2;
+        return;
+    }
 #endif
+    unpack_bits = unpack_bits_swar;
+    pack_bits = pack_bits_swar;
+}
 
-            if (!domain->input)
-                continue;
+/*****************************************************************/
 
-            for (conversion_list = domain->input_convert_list;
-                    conversion_list->copy; conversion_list++) {
-                conversion_list->copy(conversion_list);
-            }
+/* Unpack n domain bits starting at c->src:c->index to the
+ * boolean_T array c->dst */
+static void
+unpack_run(const struct endian_convert_t *c, size_t n)
+{
+    const uint8_t *src = c->src;
+    uint8_t *dst = c->dst;
+    unsigned int bit = c->index;
+    uint8_t val;
+
+    /* Leading bits up to the next byte boundary */
+    if (bit) {
+        for (val = *src++; bit < 8 && n; bit++, n--)
+            *dst++ = (val >> bit) & 1U;
+    }
+
+    if (n >= 8) {
+        unpack_bits(dst, src, n / 8);
+        dst += n & ~7UL;
+        src += n / 8;
+        n &= 7;
+    }
+
+    /* Trailing bits */
+    for (val = n ? *src : 0, bit = 0; n; bit++, n--)
+        *dst++ = (val >> bit) & 1U;
+}
+
+/*****************************************************************/
+
+/* Pack n elements of the boolean_T array c->src to the domain, starting
+ * at c->dst:c->index. Partial bytes at the start and end of the run are
+ * updated using one read-modify-write */
+static void
+pack_run(const struct endian_convert_t *c, size_t n)
+{
+    const uint8_t *src = c->src;
+    uint8_t *dst = c->dst;
+    unsigned int bit = c->index;
+    uint8_t val, mask;
+
+    /* Leading bits up to the next byte boundary */
+    if (bit) {
+        for (val = mask = 0; bit < 8 && n; bit++, n--) {
+            val |= (*src++ & 1U) << bit;
+            mask |= 1U << bit;
         }
-#if MT
-        sem_post(&master->lock);
-#endif
+        *dst = (*dst & ~mask) | val;
+        dst++;
+    }
+
+    if (n >= 8) {
+        pack_bits(dst, src, n / 8);
+        src += n & ~7UL;
+        dst += n / 8;
+        n &= 7;
+    }
+
+    /* Trailing bits */
+    if (n) {
+        for (val = mask = 0, bit = 0; n; bit++, n--) {
+            val |= (*src++ & 1U) << bit;
+            mask |= 1U << bit;
+        }
+        *dst = (*dst & ~mask) | val;
     }
 }
 
-/* Do EtherCAT output processing for a RTW task.
+/*****************************************************************/
+
+/** Fused conversion and scaling.
  *
- * It does the following:
- * - calls ecrt_master_run() for every master whose fastest task domain is in
- *   this task
- * - calls ecrt_master_send() for every domain in this task
+ * Entries with pdo_map::scale set are converted straight between the
+ * raw PDO and the scaled real_T or real32_T block signal, so that the
+ * model does not have to make another pass over a DWork. Runs of
+ * entries that are contiguous in the domain and in the model (e.g.
+ * oversampling arrays) are done in chunks: the raw values are decoded
+ * in a tight loop specialized for the common data types, followed by
+ * a loop doing the scaling.
  */
-void
-ecs_send(void)
-{
-    struct ecat_master *master;
-    struct ecat_domain *domain;
-    struct endian_convert_t *conversion_list;
-    int trigger;
-    unsigned int tid = 0;
 
-#if MT
-    tid = *(unsigned int*)pthread_getspecific(tid_key);
-#endif
+#define SCALE_CHUNK 64
 
-    if (!tid && !ETL_is_major_step())
-        return;
+/* Largest double in the range of the integer type. Beyond 53 bits the
+ * maximum is not a double, rounding it would leave the range, so the
+ * bits below the mantissa are cleared */
+static double
+pdo_max_value(const struct pdo_map *m)
+{
+    unsigned int bits = m->datatype % 1000;    /* without the sign */
+    uint64_t max;
 
-    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+    if (m->datatype / 1000 == 2)
+        bits--;
+    max = UINT64_MAX >> (64 - bits);
 
-#if MT
-        sem_wait(&master->lock);
-#endif
+    if (bits > 53)
+        max &= ~((UINT64_C(1) << (bits - 53)) - 1);
 
-        list_for_each(domain, &master->domain_list, struct ecat_domain) {
+    return (double)max;
+}
 
-#if MT
-            trigger = domain->tid != tid;
-#else
-            trigger = domain->tid_trigger;
-#endif
-            if (trigger)
-                continue;
-            domain->tid_trigger = domain->tid;
+static double
+pdo_min_value(const struct pdo_map *m)
+{
+    return m->datatype / 1000 == 2
+        ? -(double)(UINT64_C(1) << (m->datatype % 1000 - 1)) : 0.0;
+}
 
-#ifdef DEBUG_IO
-            pr_debug("%s domain(%i)\n", __func__, domain->tid);
-#endif
+/* Limit a value to [min, max] before the cast to an integer, NaN
+ * becomes 0 */
+static inline double
+saturate(double value, double min, double max)
+{
+    if (value > max)
+        return max;
+    if (value < min)
+        return min;
+    return isnan(value) ? 0.0 : value;
+}
 
-            if (domain->output) {
-                for (conversion_list = domain->output_convert_list;
-                        conversion_list->copy; conversion_list++) {
-                    conversion_list->copy(conversion_list);
-                }
-            }
+/*****************************************************************/
 
-            ecrt_domain_queue(domain->handle);
-        }
+static double
+pdo_get_value(const struct pdo_map *m, const uint8_t *src)
+{
+    unsigned int bytes = (m->datatype % 1000) / 8;
+    unsigned int i, shift;
+    uint64_t raw = 0;
 
-#if MT
-        trigger = master->fastest_tid == tid;
-#else
-        trigger = !master->tid_trigger;
-#endif
-        if (trigger) {
-            struct timespec tp;
-            master->tid_trigger = master->fastest_tid;
+    for (i = 0; i < bytes; i++)
+        raw |= (uint64_t)src[i] << 8*(m->bigendian ? bytes - 1 - i : i);
 
-#ifndef EC_HAVE_SYNC_TO
-            clock_gettime(CLOCK_MONOTONIC, &tp);
-            ecrt_master_application_time(master->handle,
-                    ETL_TIMESPEC2NANO(tp));
-#endif
+    switch (m->datatype / 1000) {
+        case 2:
+            shift = 64 - 8*bytes;
+            return (double)((int64_t)(raw << shift) >> shift);
 
-            if (master->refclk_trigger_init && !--master->refclk_trigger) {
-#ifdef EC_HAVE_SYNC_TO
-                clock_gettime(CLOCK_MONOTONIC, &tp);
-                ecrt_master_sync_reference_clock_to(master->handle,
-                        ETL_TIMESPEC2NANO(tp));
-#else
-                ecrt_master_sync_reference_clock(master->handle);
-#endif
-                master->refclk_trigger = master->refclk_trigger_init;
+        case 3:
+            if (bytes == 4) {
+                uint32_t u32 = raw;
+                float f;
+
+                memcpy(&f, &u32, 4);
+                return f;
             }
+            else {
+                double d;
 
-            ecrt_master_sync_slave_clocks(master->handle);
-            ecrt_master_send(master->handle);
+                memcpy(&d, &raw, 8);
+                return d;
+            }
 
-#ifdef DEBUG_IO
-            pr_debug("%s master(%i)\n", __func__, master->fastest_tid);
-#endif
-        }
-#if MT
-        sem_post(&master->lock);
-#endif
+        default:
+            return (double)raw;
     }
 }
 
-/***************************************************************************/
+/*****************************************************************/
 
-static struct ecat_master *
-get_master(
-        unsigned int master_id, unsigned int tid, const char **errmsg)
+static void
+pdo_set_value(const struct pdo_map *m, uint8_t *dst, double value)
 {
-    struct ecat_master *master;
+    unsigned int bytes = (m->datatype % 1000) / 8;
+    unsigned int i;
+    uint64_t raw;
+
+    switch (m->datatype / 1000) {
+        case 3:
+            if (bytes == 4) {
+                float f = value;
+                uint32_t u32;
 
-#if !MT
-    /* Note that ecs_setup_master() sets tid to ~0U! */
-    if (tid < ecat_data.nst)
-        tid = ecat_data.st[tid] / ecat_data.st[0];
-#endif
+                memcpy(&u32, &f, 4);
+                raw = u32;
+            }
+            else
+                memcpy(&raw, &value, 8);
+            break;
+
+        default:
+            value = saturate(value, pdo_min_value(m), pdo_max_value(m));
+            raw = m->datatype / 1000 == 2
+                ? (uint64_t)(int64_t)value : (uint64_t)value;
+            break;
+    }
 
-    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+    for (i = 0; i < bytes; i++)
+        dst[i] = raw >> 8*(m->bigendian ? bytes - 1 - i : i);
+}
 
-        if (master->id == master_id) {
+/*****************************************************************/
 
-            if (master->fastest_tid > tid) {
-                master->fastest_tid = tid;
-                master->tid_trigger = master->fastest_tid;
+/* Decode n contiguous raw values of type m->datatype */
+static void
+decode_values(double *val, const struct pdo_map *m,
+        const uint8_t *src, size_t n)
+{
+    size_t i;
+
+    switch (m->bigendian ? 0 : m->datatype) {
+        case 1016:
+            for (i = 0; i < n; i++, src += 2) {
+                uint16_t v;
+                memcpy(&v, src, 2);
+                val[i] = le16toh(v);
             }
+            break;
 
-            return master;
-        }
-    }
+        case 2016:
+            for (i = 0; i < n; i++, src += 2) {
+                uint16_t v;
+                memcpy(&v, src, 2);
+                val[i] = (int16_t)le16toh(v);
+            }
+            break;
 
-    master = calloc(1, sizeof(struct ecat_master));
-    master->id = master_id;
-    master->fastest_tid = tid;
-    master->tid_trigger = tid;
-#if MT
-    sem_init(&master->lock, 0, 1);
-#endif
-    INIT_LIST_HEAD(&master->domain_list);
-    list_add_tail(&master->list, &ecat_data.master_list);
+        case 1032:
+            for (i = 0; i < n; i++, src += 4) {
+                uint32_t v;
+                memcpy(&v, src, 4);
+                val[i] = le32toh(v);
+            }
+            break;
 
-    master->handle = ecrt_request_master(master_id);
+        case 2032:
+            for (i = 0; i < n; i++, src += 4) {
+                uint32_t v;
+                memcpy(&v, src, 4);
+                val[i] = (int32_t)le32toh(v);
+            }
+            break;
 
-    if (!master->handle) {
-        snprintf(errbuf, sizeof(errbuf),
-                "ecrt_request_master(%u) failed", master_id);
-        *errmsg = errbuf;
-        return NULL;
+        default:
+            for (i = 0; i < n; i++, src += (m->datatype % 1000) / 8)
+                val[i] = pdo_get_value(m, src);
+            break;
     }
-
-    return master;
 }
 
-/***************************************************************************/
+/*****************************************************************/
 
-static struct ecat_domain *
-get_domain( struct ecat_master *master, unsigned int domain_id,
+/* Encode n contiguous values to raw values of type m->datatype,
+ * saturating integers, see saturate() */
+static void
+encode_values(uint8_t *dst, const struct pdo_map *m,
+        const double *val, size_t n)
+{
+    double min = pdo_min_value(m), max = pdo_max_value(m), v;
+    size_t i;
+
+    switch (m->bigendian ? 0 : m->datatype) {
+        case 1016:
+            for (i = 0; i < n; i++, dst += 2) {
+                uint16_t raw;
+                v = saturate(val[i], min, max);
+                raw = htole16((uint16_t)v);
+                memcpy(dst, &raw, 2);
+            }
+            break;
+
+        case 2016:
+            for (i = 0; i < n; i++, dst += 2) {
+                uint16_t raw;
+                v = saturate(val[i], min, max);
+                raw = htole16((int16_t)v);
+                memcpy(dst, &raw, 2);
+            }
+            break;
+
+        case 2032:
+            for (i = 0; i < n; i++, dst += 4) {
+                uint32_t raw;
+                v = saturate(val[i], min, max);
+                raw = htole32((int32_t)v);
+                memcpy(dst, &raw, 4);
+            }
+            break;
+
+        default:
+            for (i = 0; i < n; i++, dst += (m->datatype % 1000) / 8)
+                pdo_set_value(m, dst, val[i]);
+            break;
+    }
+}
+
+/*****************************************************************/
+
+static void
+ecs_read_scaled(const struct endian_convert_t *c)
+{
+    const struct pdo_map *m = c->map;
+    double value = pdo_get_value(m, c->src)
+        * (*m->scale.gain_addr / m->scale.full_scale)
+        + *m->scale.offset_addr;
+
+    if (m->scale.type == PDO_SCALE_SINGLE)
+        *(float*)c->dst = value;
+    else
+        *(double*)c->dst = value;
+}
+
+/*****************************************************************/
+
+static void
+ecs_write_scaled(const struct endian_convert_t *c)
+{
+    const struct pdo_map *m = c->map;
+    double value = m->scale.type == PDO_SCALE_SINGLE
+        ? *(const float*)c->src : *(const double*)c->src;
+
+    pdo_set_value(m, c->dst,
+            (value * *m->scale.gain_addr + *m->scale.offset_addr)
+            * m->scale.full_scale);
+}
+
+/*****************************************************************/
+
+/* Convert and scale a run of n inputs */
+static void
+scale_in_run(const struct endian_convert_t *c, size_t n)
+{
+    const struct pdo_map *m = c->map;
+    const double k = *m->scale.gain_addr / m->scale.full_scale;
+    const double offset = *m->scale.offset_addr;
+    const int uniform = c->index;
+    double val[SCALE_CHUNK];
+    size_t i, len;
+
+    for (; n; n -= len, c += len) {
+        len = n < SCALE_CHUNK ? n : SCALE_CHUNK;
+        decode_values(val, m, c->src, len);
+
+        if (uniform) {
+            for (i = 0; i < len; i++)
+                val[i] = val[i] * k + offset;
+        }
+        else {
+            for (i = 0; i < len; i++) {
+                const struct pdo_map *mi = c[i].map;
+                val[i] = val[i]
+                    * (*mi->scale.gain_addr / mi->scale.full_scale)
+                    + *mi->scale.offset_addr;
+            }
+        }
+
+        if (m->scale.type == PDO_SCALE_SINGLE) {
+            float *dst = c->dst;
+            for (i = 0; i < len; i++)
+                dst[i] = val[i];
+        }
+        else
+            memcpy(c->dst, val, len * sizeof(double));
+    }
+}
+
+/*****************************************************************/
+
+/* Scale and convert a run of n outputs */
+static void
+scale_out_run(const struct endian_convert_t *c, size_t n)
+{
+    const struct pdo_map *m = c->map;
+    const double gain = *m->scale.gain_addr;
+    const double offset = *m->scale.offset_addr;
+    const double full_scale = m->scale.full_scale;
+    const int uniform = c->index;
+    double val[SCALE_CHUNK];
+    size_t i, len;
+
+    for (; n; n -= len, c += len) {
+        len = n < SCALE_CHUNK ? n : SCALE_CHUNK;
+
+        if (m->scale.type == PDO_SCALE_SINGLE) {
+            const float *src = c->src;
+            for (i = 0; i < len; i++)
+                val[i] = src[i];
+        }
+        else
+            memcpy(val, c->src, len * sizeof(double));
+
+        if (uniform) {
+            for (i = 0; i < len; i++)
+                val[i] = (val[i] * gain + offset) * full_scale;
+        }
+        else {
+            for (i = 0; i < len; i++) {
+                const struct pdo_map *mi = c[i].map;
+                val[i] = (val[i] * *mi->scale.gain_addr
+                        + *mi->scale.offset_addr) * mi->scale.full_scale;
+            }
+        }
+
+        encode_values(c->dst, m, val, len);
+    }
+}
+
+/*****************************************************************/
+
+/* Check whether c continues the run of scaled entries ending with prev:
+ * same data types, and contiguous in the domain as well as in the model */
+static int
+scale_adjacent(const struct endian_convert_t *prev,
+        const struct endian_convert_t *c, char input)
+{
+    const struct pdo_map *m1 = prev->map, *m2 = c->map;
+    const uint8_t *p1 = input ? prev->src : prev->dst;
+    const uint8_t *p2 = input ? c->src : c->dst;
+    const uint8_t *s1 = input ? prev->dst : prev->src;
+    const uint8_t *s2 = input ? c->dst : c->src;
+    size_t size = m1->scale.type == PDO_SCALE_SINGLE
+        ? sizeof(float) : sizeof(double);
+
+    return m1->datatype == m2->datatype
+        && m1->bigendian == m2->bigendian
+        && m1->scale.type == m2->scale.type
+        && p2 - p1 == (ptrdiff_t)(m1->datatype % 1000) / 8
+        && s2 - s1 == (ptrdiff_t)size;
+}
+
+/*****************************************************************/
+
+/* Check whether two scaled entries always use the same scaling, i.e.
+ * share tunable parameters or have equal constants */
+static int
+scale_uniform(const struct pdo_map *m1, const struct pdo_map *m2)
+{
+    return m1->scale.full_scale == m2->scale.full_scale
+        && (m1->scale.gain_addr == m2->scale.gain_addr
+                || (m1->scale.gain_addr == &m1->scale.gain
+                    && m2->scale.gain_addr == &m2->scale.gain
+                    && m1->scale.gain == m2->scale.gain))
+        && (m1->scale.offset_addr == m2->scale.offset_addr
+                || (m1->scale.offset_addr == &m1->scale.offset
+                    && m2->scale.offset_addr == &m2->scale.offset
+                    && m1->scale.offset == m2->scale.offset));
+}
+
+/*****************************************************************/
+
+/* Prepare a scaled pdo_map for the cyclic functions, so that these
+ * can always use gain_addr and offset_addr */
+static void
+init_scale(struct pdo_map *m)
+{
+    if (!m->scale.full_scale)
+        m->scale.full_scale = 1.0;
+    if (!m->scale.gain_addr)
+        m->scale.gain_addr = &m->scale.gain;
+    if (!m->scale.offset_addr)
+        m->scale.offset_addr = &m->scale.offset;
+}
+
+/*****************************************************************/
+
+/** Conversion plan compiler.
+ *
+ * Instead of calling the conversion function of every single PDO entry
+ * in the cyclic path, the conversion list of a domain is compiled into a
+ * plan once at ecs_start_slaves():
+ *  - the list is sorted by domain offset
+ *  - byte aligned entries that do not need byte swapping and are
+ *    contiguous in the domain as well as in the model are merged into
+ *    a single memcpy() block
+ *  - runs of the same byte swapping operation are done in a tight loop
+ *  - runs of adjacent 1 bit entries are (un)packed a byte at a time
+ *  - runs of contiguous scaled entries are converted in chunks
+ *  - all other entries are called through the function pointer as before
+ */
+
+/* Classification of a conversion function */
+struct plan_class {
+    void (*copy)(const struct endian_convert_t*);
+    enum plan_op op;
+    size_t len;
+};
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+static const struct plan_class plan_class[] = {
+    {ecs_copy_uint8,      PLAN_COPY,   1},
+    {ecs_read_uint1,      PLAN_UNPACK, 1},
+    {ecs_write_uint1,     PLAN_PACK,   1},
+    {ecs_read_scaled,     PLAN_SCALE_IN,  0},
+    {ecs_write_scaled,    PLAN_SCALE_OUT, 0},
+    {ecs_read_le_uint16,  PLAN_COPY,   2},
+    {ecs_read_le_uint32,  PLAN_COPY,   4},
+    {ecs_read_le_uint64,  PLAN_COPY,   8},
+    {ecs_read_le_single,  PLAN_COPY,   4},
+    {ecs_read_le_double,  PLAN_COPY,   8},
+    {ecs_write_le_uint16, PLAN_COPY,   2},
+    {ecs_write_le_uint32, PLAN_COPY,   4},
+    {ecs_write_le_uint64, PLAN_COPY,   8},
+    {ecs_write_le_single, PLAN_COPY,   4},
+    {ecs_write_le_double, PLAN_COPY,   8},
+    {ecs_read_be_uint16,  PLAN_SWAP16, 2},
+    {ecs_read_be_uint32,  PLAN_SWAP32, 4},
+    {ecs_read_be_uint64,  PLAN_SWAP64, 8},
+    {ecs_read_be_single,  PLAN_SWAP32, 4},
+    {ecs_read_be_double,  PLAN_SWAP64, 8},
+    {ecs_write_be_uint16, PLAN_SWAP16, 2},
+    {ecs_write_be_uint32, PLAN_SWAP32, 4},
+    {ecs_write_be_uint64, PLAN_SWAP64, 8},
+    {ecs_write_be_single, PLAN_SWAP32, 4},
+    {ecs_write_be_double, PLAN_SWAP64, 8},
+    {NULL,},
+};
+#else
+static const struct plan_class plan_class[] = {
+    {ecs_copy_uint8,      PLAN_COPY,   1},
+    {ecs_read_uint1,      PLAN_UNPACK, 1},
+    {ecs_write_uint1,     PLAN_PACK,   1},
+    {ecs_read_scaled,     PLAN_SCALE_IN,  0},
+    {ecs_write_scaled,    PLAN_SCALE_OUT, 0},
+    {ecs_read_be_uint16,  PLAN_COPY,   2},
+    {ecs_read_be_uint32,  PLAN_COPY,   4},
+    {ecs_read_be_uint64,  PLAN_COPY,   8},
+    {ecs_read_be_single,  PLAN_COPY,   4},
+    {ecs_read_be_double,  PLAN_COPY,   8},
+    {ecs_write_be_uint16, PLAN_COPY,   2},
+    {ecs_write_be_uint32, PLAN_COPY,   4},
+    {ecs_write_be_uint64, PLAN_COPY,   8},
+    {ecs_write_be_single, PLAN_COPY,   4},
+    {ecs_write_be_double, PLAN_COPY,   8},
+    {ecs_read_le_uint16,  PLAN_SWAP16, 2},
+    {ecs_read_le_uint32,  PLAN_SWAP32, 4},
+    {ecs_read_le_uint64,  PLAN_SWAP64, 8},
+    {ecs_read_le_single,  PLAN_SWAP32, 4},
+    {ecs_read_le_double,  PLAN_SWAP64, 8},
+    {ecs_write_le_uint16, PLAN_SWAP16, 2},
+    {ecs_write_le_uint32, PLAN_SWAP32, 4},
+    {ecs_write_le_uint64, PLAN_SWAP64, 8},
+    {ecs_write_le_single, PLAN_SWAP32, 4},
+    {ecs_write_le_double, PLAN_SWAP64, 8},
+    {NULL,},
+};
+#endif
+
+/*****************************************************************/
+
+static const struct plan_class *
+get_plan_class(void (*copy)(const struct endian_convert_t*))
+{
+    const struct plan_class *c;
+
+    for (c = plan_class; c->copy; c++)
+        if (c->copy == copy)
+            break;
+
+    return c;
+}
+
+/*****************************************************************/
+
+/* Sort key of an entry is its address in the domain, i.e. the source
+ * for input and the destination for output conversions. Bit entries
+ * sharing the same byte are sorted by bit position */
+static int
+plan_compare(const uint8_t *p1, size_t bit1, const uint8_t *p2, size_t bit2)
+{
+    if (p1 != p2)
+        return p1 < p2 ? -1 : 1;
+
+    return bit1 < bit2 ? -1 : bit1 > bit2;
+}
+
+static int
+plan_compare_input(const void *a, const void *b)
+{
+    const struct endian_convert_t *c1 = a, *c2 = b;
+
+    return plan_compare(c1->src, c1->index, c2->src, c2->index);
+}
+
+static int
+plan_compare_output(const void *a, const void *b)
+{
+    const struct endian_convert_t *c1 = a, *c2 = b;
+
+    return plan_compare(c1->dst, c1->index, c2->dst, c2->index);
+}
+
+/*****************************************************************/
+
+/* Compile a zero terminated conversion list with count entries into
+ * a plan. Returns NULL if memory is exhausted, in which case the list
+ * must be used directly. */
+static struct plan_step *
+compile_plan(const struct endian_convert_t *list, size_t count, char input)
+{
+    struct plan_step *plan, *step;
+    struct endian_convert_t *sorted, *entry;
+    const struct endian_convert_t *c;
+    int extend;
+
+    plan = calloc(count + 1, sizeof(*plan));
+    sorted = calloc(count + 1, sizeof(*sorted));
+    if (!plan || !sorted) {
+        free(plan);
+        free(sorted);
+        return NULL;
+    }
+
+    memcpy(sorted, list, count * sizeof(*sorted));
+    qsort(sorted, count, sizeof(*sorted),
+            input ? plan_compare_input : plan_compare_output);
+
+    /* The steps reference runs in sorted[]. PLAN_COPY steps are merged
+     * in place, so that entry is the next free slot in sorted[] */
+    step = plan - 1;
+    entry = sorted;
+    for (c = sorted; c != sorted + count; c++) {
+        const struct plan_class *class = get_plan_class(c->copy);
+        enum plan_op op = class->copy ? class->op : PLAN_CALL;
+
+        if (op == PLAN_COPY && step >= plan && step->op == PLAN_COPY) {
+            struct endian_convert_t *block = entry - 1;
+
+            if ((const uint8_t*)block->src + block->index == c->src
+                    && (uint8_t*)block->dst + block->index == c->dst) {
+                block->index += class->len;
+                continue;
+            }
+        }
+
+        *entry = *c;
+        if (op == PLAN_COPY)
+            entry->index = class->len;
+
+        /* Extend the current run if possible */
+        extend = step >= plan && step->op == op && op != PLAN_COPY;
+        if (extend && (op == PLAN_UNPACK || op == PLAN_PACK)) {
+            const struct endian_convert_t *prev = entry - 1;
+            const uint8_t *p1 = input ? prev->src : prev->dst;
+            const uint8_t *p2 = input ? c->src : c->dst;
+            const uint8_t *m1 = input ? prev->dst : prev->src;
+            const uint8_t *m2 = input ? c->dst : c->src;
+
+            /* Bits as well as model elements have to be adjacent */
+            extend = (p2 - p1) * 8 + c->index - prev->index == 1
+                && m2 - m1 == 1;
+        }
+        else if (extend) {
+            extend = (op != PLAN_SCALE_IN && op != PLAN_SCALE_OUT)
+                || scale_adjacent(entry - 1, c, input);
+        }
+
+        if (op == PLAN_SCALE_IN || op == PLAN_SCALE_OUT) {
+            /* Mark the run if gain and offset are the same for all */
+            struct endian_convert_t *first =
+                extend ? entry - step->count : entry;
+
+            entry->index = 0;
+            first->index = (extend ? first->index : 1)
+                && scale_uniform(first->map, c->map);
+        }
+
+        if (!extend) {
+            ++step;
+            step->op = op;
+            step->list = entry;
+        }
+        step->count++;
+        entry++;
+    }
+
+    pr_debug("Compiled %zu entries into %zi steps\n", count, step - plan + 1);
+
+    if (step < plan)
+        free(sorted);
+
+    return plan;
+}
+
+/* Free a plan together with the sorted list its steps reference */
+static void
+free_plan(struct plan_step *plan)
+{
+    if (!plan)
+        return;
+
+    free((void *)plan->list);
+    free(plan);
+}
+
+/*****************************************************************/
+
+static void
+run_plan(const struct plan_step *step)
+{
+    for (; step->op; step++) {
+        const struct endian_convert_t *c = step->list;
+        const struct endian_convert_t *end = c + step->count;
+
+        switch (step->op) {
+            case PLAN_COPY:
+                memcpy(c->dst, c->src, c->index);
+                break;
+
+            case PLAN_SWAP16:
+                for (; c != end; c++)
+                    *(uint16_t*)c->dst = bswap_16(*(const uint16_t*)c->src);
+                break;
+
+            case PLAN_SWAP32:
+                for (; c != end; c++)
+                    *(uint32_t*)c->dst = bswap_32(*(const uint32_t*)c->src);
+                break;
+
+            case PLAN_SWAP64:
+                for (; c != end; c++)
+                    *(uint64_t*)c->dst = bswap_64(*(const uint64_t*)c->src);
+                break;
+
+            case PLAN_UNPACK:
+                unpack_run(c, step->count);
+                break;
+
+            case PLAN_PACK:
+                pack_run(c, step->count);
+                break;
+
+            case PLAN_SCALE_IN:
+                scale_in_run(c, step->count);
+                break;
+
+            case PLAN_SCALE_OUT:
+                scale_out_run(c, step->count);
+                break;
+
+            default:
+                for (; c != end; c++)
+                    c->copy(c);
+                break;
+        }
+    }
+}
+
+/*****************************************************************/
+
+/* Convert the PDO entries of a domain, using the plan if available */
+static void
+convert(const struct plan_step *plan, const struct endian_convert_t *list)
+{
+    if (plan) {
+        run_plan(plan);
+        return;
+    }
+
+    for (; list->copy; list++)
+        list->copy(list);
+}
+
+/*****************************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ETL_TIMESPEC2NANO(tp);
+}
+
+#if MT
+/* Get the io_state of a remote domain.
+ *
+ * If the domain was sent, the owner of the master processes it in its
+ * next ecs_receive(). Usually this is running concurrently on another
+ * CPU, so wait for it, but no longer than timeout ns.
+ *
+ * A domain that has not even been sent is not waited for: the owner is
+ * late, and the task continues with its previous inputs */
+static int
+domain_io_wait(const int *io_state, uint64_t timeout)
+{
+    int state = __atomic_load_n(io_state, __ATOMIC_ACQUIRE);
+    uint64_t end;
+
+    if (state != DOMAIN_IO_SENT)
+        return state;
+
+    end = monotonic_ns() + timeout;
+
+    do {
+        cpu_relax();
+        state = __atomic_load_n(io_state, __ATOMIC_ACQUIRE);
+        if (state != DOMAIN_IO_SENT)
+            break;
+    } while (monotonic_ns() < end);
+
+    return state;
+}
+#endif
+
+/*****************************************************************/
+
+static void send_statistics(int idx, uint64_t start);
+
+/* Poll for the return of the frames sent at the time start, but no
+ * longer than until the deadline.
+ *
+ * The frames are back when the working counter of the polled domain is
+ * no longer zero. The domain is processed again in master_receive().
+ * Returns the round trip time in ns, or 0 if the frames did not return
+ * in time */
+static uint64_t
+master_poll(struct task_master *m, uint64_t start)
+{
+    struct task_domain *d = m->poll;
+    uint64_t now, end = start + m->deadline;
+    unsigned int polls = 0;
+    int returned = 0;
+
+    do {
+        cpu_relax();
+        ecrt_master_receive(m->handle);
+        polls++;
+        now = monotonic_ns();
+
+        if (!d)
+            continue;
+
+        ecrt_domain_process(d->handle);
+        ecrt_domain_state(d->handle, d->state);
+        returned = d->state->wc_state != EC_WC_ZERO;
+    } while (!returned && now < end);
+
+    if (m->stats >= 0) {
+        ecat_stats.round_trip[m->stats] = 1.0e-9 * (now - start);
+        ecat_stats.poll_count[m->stats] = polls;
+    }
+
+    return returned ? now - start : 0;
+}
+
+/* Report the result of the calibration of a master. The master keeps
+ * its slaves configured while the model is restarted, so the shift time
+ * only takes effect when the model is rebuilt with it.
+ *
+ * The task wakes up on multiples of the period, so SYNC0 fires
+ * shift_time after the wakeup. It must not fire before the frames passed
+ * the slaves, which is before they returned to the master */
+static void
+calibrate_finish(struct ecat_master *master)
+{
+    uint64_t shift = master->calib.send_max + master->calib.round_trip_max
+        + ecat_data.calibrate_margin;
+    unsigned int n = master->calib.count - master->calib.lost;
+
+    /* Round up to us */
+    shift = (shift + 999) / 1000 * 1000;
+
+    if (master->id < ECS_MAX_MASTERS)
+        ecat_stats.shift_time[master->id] = 1.0e-9 * shift;
+
+    syslog(LOG_INFO, "EtherCAT master %u calibration over %u cycles: "
+            "send offset mean %llu max %llu ns, round trip mean %llu "
+            "max %llu ns, %u frames lost; SYNC0 shift time %llu ns",
+            master->id, master->calib.count,
+            (unsigned long long)(master->calib.send_sum
+                / master->calib.count),
+            (unsigned long long)master->calib.send_max,
+            (unsigned long long)(n ? master->calib.round_trip_sum / n : 0),
+            (unsigned long long)master->calib.round_trip_max,
+            master->calib.lost, (unsigned long long)shift);
+
+}
+
+/* Accumulate a cycle of the SYNC0 shift time calibration. The frames
+ * were sent at the time sent and returned round_trip ns later */
+static void
+calibrate(struct task_master *m, uint64_t sent, uint64_t round_trip)
+{
+    struct ecat_master *master = m->master;
+    const struct timespec *wakeup = pthread_getspecific(monotonic_time_key);
+    uint64_t offset;
+
+    if (!wakeup)
+        return;
+
+    offset = sent - ETL_TIMESPEC2NANO(*wakeup);
+
+    master->calib.count++;
+    master->calib.send_sum += offset;
+    if (offset > master->calib.send_max)
+        master->calib.send_max = offset;
+
+    /* A lost frame may still have passed the slaves before the deadline */
+    if (round_trip)
+        master->calib.round_trip_sum += round_trip;
+    else {
+        master->calib.lost++;
+        round_trip = m->deadline;
+    }
+    if (round_trip > master->calib.round_trip_max)
+        master->calib.round_trip_max = round_trip;
+
+    if (!--master->calib.cycles)
+        calibrate_finish(master);
+}
+
+/* Turnaround mode: send the frames queued by the previous ecs_send() and
+ * poll for their return */
+static void
+master_turnaround(struct task_master *m)
+{
+    uint64_t start = monotonic_ns(), round_trip;
+
+    ecrt_master_send(m->handle);
+    if (m->stats >= 0)
+        send_statistics(m->stats, start);
+
+    round_trip = master_poll(m, start);
+    if (m->master->calib.cycles)
+        calibrate(m, start, round_trip);
+}
+
+/* Input processing of a master in the dispatch table of a task */
+static void
+master_receive(struct task_master *m)
+{
+    struct task_domain *d;
+    uint64_t start = 0;
+    int trigger;
+
+#if MT
+    trigger = m->owner;
+#else
+    trigger = !--m->tid_trigger;
+#endif
+
+    if (trigger) {
+#ifdef EC_HAVE_SYNC_TO
+        struct timespec *monotonic_time =
+            (struct timespec *) pthread_getspecific(monotonic_time_key);
+
+        ecrt_master_application_time(m->handle,
+                ETL_TIMESPEC2NANO(*monotonic_time));
+#endif
+        if (m->stats >= 0)
+            start = monotonic_ns();
+
+        if (m->io_mode == ECS_IO_TURNAROUND)
+            master_turnaround(m);
+        else
+            ecrt_master_receive(m->handle);
+        ecrt_master_state(m->handle, &m->master->state);
+
+#ifdef DEBUG_IO
+        pr_debug("%s master(%i)\n", __func__, m->master->fastest_tid);
+#endif
+    }
+
+    for (d = m->domain; d != m->domain_end; d++) {
+
+#if MT
+        if (d->mode == DOMAIN_REMOTE) {
+            if (domain_io_wait(d->io_state, m->timeout)
+                    != DOMAIN_IO_READY)
+                continue;
+
+            if (d->input_list)
+                convert(d->input_plan, d->input_list);
+
+            __atomic_store_n(d->io_state,
+                    DOMAIN_IO_IDLE, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (d->mode == DOMAIN_PROXY
+                && __atomic_load_n(d->io_state, __ATOMIC_ACQUIRE)
+                != DOMAIN_IO_SENT)
+            continue;
+#else
+        if (--d->tid_trigger)
+            continue;
+#endif
+
+        ecrt_domain_process(d->handle);
+        ecrt_domain_state(d->handle, d->state);
+
+#ifdef DEBUG_IO
+        pr_debug("%s domain(%p)\n", __func__, d->handle);
+#endif
+
+#if MT
+        if (d->mode == DOMAIN_PROXY) {
+            __atomic_store_n(d->io_state,
+                    DOMAIN_IO_READY, __ATOMIC_RELEASE);
+            continue;
+        }
+#endif
+
+        if (d->input_list)
+            convert(d->input_plan, d->input_list);
+    }
+
+    if (start)
+        ecat_stats.receive_time[m->stats] = 1.0e-9 * (monotonic_ns() - start);
+}
+
+/* Update the send statistics of a master after ecrt_master_send() */
+static void
+send_statistics(int idx, uint64_t start)
+{
+    const struct timespec *wakeup = pthread_getspecific(monotonic_time_key);
+    uint64_t now = monotonic_ns();
+    double offset, jitter;
+
+    ecat_stats.send_time[idx] = 1.0e-9 * (now - start);
+
+    if (!wakeup)
+        return;
+
+    offset = 1.0e-9 * (int64_t)(now - ETL_TIMESPEC2NANO(*wakeup));
+
+    /* No jitter for the first send */
+    jitter = ecat_stats.send_offset[idx]
+        ? offset - ecat_stats.send_offset[idx] : 0.0;
+
+    ecat_stats.send_offset[idx] = offset;
+    ecat_stats.send_jitter[idx] = jitter >= 0.0 ? jitter : -jitter;
+}
+
+/* Wait for the release time of the outputs of a master, i.e. the wakeup
+ * of the task plus m->release. Sleep most of the time and busy wait the
+ * last ECS_RELEASE_SPIN ns.
+ *
+ * If the outputs are late, they are sent at once, counting an overrun */
+static void
+release_wait(const struct task_master *m)
+{
+    const struct timespec *wakeup = pthread_getspecific(monotonic_time_key);
+    uint64_t release, now = monotonic_ns();
+
+    if (!wakeup)
+        return;
+
+    release = ETL_TIMESPEC2NANO(*wakeup) + m->release;
+    if (now > release) {
+        if (m->stats >= 0)
+            ecat_stats.release_overruns[m->stats]++;
+        return;
+    }
+
+    if (release - now > ECS_RELEASE_SPIN) {
+        struct timespec tp;
+
+        tp.tv_sec  = (release - ECS_RELEASE_SPIN) / 1000000000ULL;
+        tp.tv_nsec = (release - ECS_RELEASE_SPIN) % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, NULL);
+    }
+
+    while (monotonic_ns() < release)
+        cpu_relax();
+}
+
+/* Bus clock mode: steer the wakeup of the tasks to the reference clock.
+ *
+ * The reference clock time is latched when the frame sent in the
+ * previous cycle of the master passes the reference clock. Ideally, it
+ * advances by exactly a period per cycle. The sum of the deviations is
+ * the phase error of the wakeup with respect to the bus clock, which a
+ * PI controller turns into a correction of the next wakeup. The phase is
+ * locked to where it was at the first sample */
+static void
+bus_clock(struct task_master *m)
+{
+    struct ecat_master *master = m->master;
+    double limit = 1.0e-6 * ECS_PLL_LIMIT * master->pll.period;
+    double output;
+    uint32_t ref_time;
+    int32_t diff;
+
+    if (ecrt_master_reference_clock_time(m->handle, &ref_time)) {
+        /* No new sample */
+        if (master->pll.cycles)
+            master->pll.cycles++;
+        return;
+    }
+
+    if (!master->pll.cycles) {
+        master->pll.ref_time = ref_time;
+        master->pll.cycles = 1;
+        return;
+    }
+
+    diff = ref_time - master->pll.ref_time
+        - master->pll.cycles * master->pll.period;
+    master->pll.ref_time = ref_time;
+    master->pll.cycles = 1;
+
+    /* A step of the reference clock, e.g. when the master sets its
+     * offset, is not a phase error */
+    if (diff > (int)master->pll.period / 2
+            || diff < -(int)master->pll.period / 2)
+        return;
+
+    master->pll.phase += diff;
+
+    /* Positive if the wakeup is late, so the period has to be shortened */
+    master->pll.integral -= ECS_PLL_KI * master->pll.phase;
+    if (master->pll.integral > limit)
+        master->pll.integral = limit;
+    else if (master->pll.integral < -limit)
+        master->pll.integral = -limit;
+
+    output = master->pll.integral - ECS_PLL_KP * master->pll.phase;
+    if (output > limit)
+        output = limit;
+    else if (output < -limit)
+        output = -limit;
+
+    __atomic_add_fetch(&ecat_data.clock_offset, (int64_t)output,
+            __ATOMIC_RELAXED);
+
+    if (m->stats >= 0) {
+        ecat_stats.phase_error[m->stats] = 1.0e-9 * master->pll.phase;
+        ecat_stats.clock_correction[m->stats] = 1.0e-9 * output;
+    }
+}
+
+/* Output processing of a master in the dispatch table of a task */
+static void
+master_send(struct task_master *m)
+{
+    struct ecat_master *master = m->master;
+    struct task_domain *d;
+    uint64_t start = 0;
+    int trigger;
+
+#if MT
+    trigger = m->owner;
+#else
+    trigger = !m->tid_trigger;
+#endif
+
+    if (trigger && m->stats >= 0)
+        start = monotonic_ns();
+
+    for (d = m->domain; d != m->domain_end; d++) {
+
+#if MT
+        if (d->mode == DOMAIN_PROXY) {
+            if (__atomic_load_n(d->io_state, __ATOMIC_ACQUIRE)
+                    != DOMAIN_IO_QUEUE)
+                continue;
+
+            ecrt_domain_queue(d->handle);
+            __atomic_store_n(d->io_state,
+                    DOMAIN_IO_SENT, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if (d->mode == DOMAIN_REMOTE) {
+            /* Still with the owner after a timeout in ecs_receive() */
+            if (__atomic_load_n(d->io_state, __ATOMIC_ACQUIRE)
+                    != DOMAIN_IO_IDLE)
+                continue;
+
+            if (d->output_list)
+                convert(d->output_plan, d->output_list);
+
+            __atomic_store_n(d->io_state,
+                    DOMAIN_IO_QUEUE, __ATOMIC_RELEASE);
+            continue;
+        }
+#else
+        if (d->tid_trigger)
+            continue;
+        d->tid_trigger = d->tid;
+#endif
+
+#ifdef DEBUG_IO
+        pr_debug("%s domain(%p)\n", __func__, d->handle);
+#endif
+
+        if (d->output_list)
+            convert(d->output_plan, d->output_list);
+
+        ecrt_domain_queue(d->handle);
+    }
+
+    if (trigger) {
+        struct timespec tp;
+#if !MT
+        m->tid_trigger = m->fastest_tid;
+#endif
+
+#ifndef EC_HAVE_SYNC_TO
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        ecrt_master_application_time(m->handle,
+                ETL_TIMESPEC2NANO(tp));
+#endif
+
+        /* In bus clock mode, the reference clock is the master clock */
+        if (m->bus_clock)
+            bus_clock(m);
+        else if (master->refclk_trigger_init
+                && !--master->refclk_trigger) {
+#ifdef EC_HAVE_SYNC_TO
+            clock_gettime(CLOCK_MONOTONIC, &tp);
+            ecrt_master_sync_reference_clock_to(m->handle,
+                    ETL_TIMESPEC2NANO(tp));
+#else
+            ecrt_master_sync_reference_clock(m->handle);
+#endif
+            master->refclk_trigger = master->refclk_trigger_init;
+        }
+
+        ecrt_master_sync_slave_clocks(m->handle);
+
+        if (m->release)
+            release_wait(m);
+
+        /* In turnaround mode, the frames are sent in ecs_receive() */
+        if (m->io_mode != ECS_IO_TURNAROUND) {
+            uint64_t sent = master->calib.cycles && m->poll
+                ? monotonic_ns() : 0;
+
+            ecrt_master_send(m->handle);
+
+            /* The calibration has to poll for the frames */
+            if (sent)
+                calibrate(m, sent, master_poll(m, sent));
+        }
+        else
+            start = 0;
+
+#ifdef DEBUG_IO
+        pr_debug("%s master(%i)\n", __func__, master->fastest_tid);
+#endif
+    }
+
+    if (start)
+        send_statistics(m->stats, start);
+}
+
+/* Input processing of a master in ecs_receive(). In pipelined mode, the
+ * outputs of the previous cycle are sent right away */
+static void
+master_input(struct task_master *m)
+{
+    master_receive(m);
+
+    if (m->io_mode == ECS_IO_PIPELINED)
+        master_send(m);
+}
+
+/* Output processing of a master in ecs_send() */
+static void
+master_output(struct task_master *m)
+{
+    if (m->io_mode != ECS_IO_PIPELINED)
+        master_send(m);
+}
+
+/*****************************************************************/
+
+/* Main loop of a worker thread, see struct ecat_worker. Should the
+ * worker share its CPU with task 0, sched_yield() lets the task run.
+ * While task 0 does not release the workers for two of its periods, e.g.
+ * before the start or during a restart, they poll every WORKER_POLL ns */
+#define WORKER_POLL     100000
+
+static void *
+worker_main(void *arg)
+{
+    static const struct timespec poll = { 0, WORKER_POLL };
+    struct ecat_worker *w = arg;
+    void *time = NULL;
+    uint64_t idle, now;
+    unsigned int spin;
+    int seq = 0;
+
+    for (;;) {
+        spin = 0;
+        idle = 0;
+        while (__atomic_load_n(&ecat_data.worker_seq, __ATOMIC_ACQUIRE)
+                == seq) {
+            cpu_relax();
+            if (++spin % 1000)
+                continue;
+
+            now = monotonic_ns();
+            if (!idle)
+                idle = now + 2ULL * ecat_data.st[0];
+            if (now < idle)
+                sched_yield();
+            else
+                nanosleep(&poll, NULL);
+        }
+        seq++;
+
+        if (ecat_data.worker_time != time) {
+            time = ecat_data.worker_time;
+            pthread_setspecific(monotonic_time_key, time);
+        }
+
+        switch (ecat_data.worker_job) {
+            case WORKER_RECEIVE:
+                master_input(w->master);
+                break;
+
+            case WORKER_SEND:
+                master_output(w->master);
+                break;
+
+            default:
+                return NULL;
+        }
+
+        __atomic_add_fetch(&ecat_data.worker_done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Release all workers with a job and wait until they are finished.
+ *
+ * Should a worker share its CPU with task 0, sched_yield() lets it run,
+ * because it has the priority of task 0. */
+static void
+run_workers(enum worker_job job)
+{
+    int n = ecat_data.worker_end - ecat_data.worker;
+    unsigned int spin = 0;
+
+    __atomic_store_n(&ecat_data.worker_done, 0, __ATOMIC_RELAXED);
+    ecat_data.worker_job = job;
+    if (job != WORKER_EXIT)
+        ecat_data.worker_time = pthread_getspecific(monotonic_time_key);
+    __atomic_add_fetch(&ecat_data.worker_seq, 1, __ATOMIC_RELEASE);
+
+    if (job == WORKER_EXIT)
+        return;
+
+    while (__atomic_load_n(&ecat_data.worker_done, __ATOMIC_ACQUIRE) != n) {
+        cpu_relax();
+        if (++spin > 1000)
+            sched_yield();
+    }
+}
+
+/* Create the workers for the masters of task 0. If a worker cannot be
+ * created, task 0 services the remaining masters itself */
+static void
+start_workers(const struct ecat_task *task)
+{
+    struct task_master *m;
+    struct ecat_worker *w;
+
+    w = calloc(task->master_end - task->master, sizeof(*w));
+    if (!w) {
+        ecat_data.workers = 0;
+        return;
+    }
+
+    ecat_data.worker = ecat_data.worker_end = w;
+
+    /* The workers count the releases from 0, also after a restart */
+    ecat_data.worker_seq = 0;
+    ecat_data.worker_time = NULL;
+
+    for (m = task->master; m != task->master_end; m++, w++) {
+        unsigned int idx = m->master->id;
+        pthread_attr_t attr;
+        int err;
+
+        w->master = m;
+
+        pthread_attr_init(&attr);
+        if (ecat_data.worker_priority) {
+            struct sched_param param = {
+                .sched_priority = ecat_data.worker_priority,
+            };
+
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &param);
+        }
+        if (idx < ecat_data.worker_cpu_count) {
+            cpu_set_t cpuset;
+
+            CPU_ZERO(&cpuset);
+            CPU_SET(ecat_data.worker_cpu[idx], &cpuset);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        }
+
+        err = pthread_create(&w->thread, &attr, worker_main, w);
+        if (err == EPERM && ecat_data.worker_priority) {
+            fprintf(stderr, "EtherCAT workers: SCHED_FIFO priority %i "
+                    "not permitted, inheriting the scheduling\n",
+                    ecat_data.worker_priority);
+            ecat_data.worker_priority = 0;
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+            err = pthread_create(&w->thread, &attr, worker_main, w);
+        }
+        pthread_attr_destroy(&attr);
+
+        if (err) {
+            fprintf(stderr, "Creating EtherCAT worker for master %u "
+                    "failed: %s\n", m->master->id, strerror(err));
+            break;
+        }
+
+        ecat_data.worker_end = w + 1;
+    }
+}
+
+/* Stop and join the workers */
+static void
+stop_workers(void)
+{
+    struct ecat_worker *w;
+
+    if (!ecat_data.worker)
+        return;
+
+    run_workers(WORKER_EXIT);
+    for (w = ecat_data.worker; w != ecat_data.worker_end; w++)
+        pthread_join(w->thread, NULL);
+
+    free(ecat_data.worker);
+    ecat_data.worker = ecat_data.worker_end = NULL;
+}
+
+/*****************************************************************/
+
+/* Do input processing for a RTW task.
+ *
+ * It does the following:
+ *  - calls ecrt_master_receive() for every master whose fastest domain is in
+ *    this task.
+ *  - calls ecrt_domain_process() for every domain in this task, or with MT,
+ *    for every remote domain handed over to this task
+ *  - converts the inputs of the task's domains
+ *  - for masters in pipelined I/O mode, sends the outputs of the previous
+ *    cycle like ecs_send()
+ *  - for masters in turnaround I/O mode, sends the frames queued by the
+ *    previous ecs_send() and polls for their return before processing
+ *
+ * With workers, task 0 hands its masters over to the worker threads.
+ */
+void
+ecs_receive(void)
+{
+    struct ecat_task *task;
+    struct task_master *m;
+    unsigned int tid = 0;
+    uint64_t start;
+
+#if MT
+    tid = *(unsigned int*)pthread_getspecific(tid_key);
+#endif
+
+    if (!tid && !ETL_is_major_step())
+        return;
+
+    start = monotonic_ns();
+    task = ecat_data.task + tid;
+    m = task->master;
+
+    if (!tid && ecat_data.worker != ecat_data.worker_end) {
+        run_workers(WORKER_RECEIVE);
+        m += ecat_data.worker_end - ecat_data.worker;
+    }
+
+    for (; m != task->master_end; m++)
+        master_input(m);
+
+    task->io_time = monotonic_ns() - start;
+}
+
+/* Do EtherCAT output processing for a RTW task.
+ *
+ * It does the following:
+ * - calls ecrt_master_run() for every master whose fastest task domain is in
+ *   this task
+ * - calls ecrt_master_send() for every domain in this task
+ * - with MT, hands over the task's remote domains to the owner of the
+ *   master, and queues the remote domains handed over to this task
+ *
+ * Masters in pipelined I/O mode were already sent in ecs_receive().
+ * Their outputs stay with the model until the next ecs_receive().
+ * Masters in turnaround I/O mode are queued, but only sent by the next
+ * ecs_receive().
+ */
+void
+ecs_send(void)
+{
+    struct ecat_task *task;
+    struct task_master *m;
+    unsigned int tid = 0;
+    uint64_t start;
+
+#if MT
+    tid = *(unsigned int*)pthread_getspecific(tid_key);
+#endif
+
+    if (!tid && !ETL_is_major_step())
+        return;
+
+    start = monotonic_ns();
+    task = ecat_data.task + tid;
+    m = task->master;
+
+    if (!tid && ecat_data.worker != ecat_data.worker_end) {
+        run_workers(WORKER_SEND);
+        m += ecat_data.worker_end - ecat_data.worker;
+    }
+
+    for (; m != task->master_end; m++)
+        master_output(m);
+
+    task->io_time += monotonic_ns() - start;
+}
+
+/***************************************************************************/
+
+static struct ecat_master *
+get_master(
+        unsigned int master_id, unsigned int tid, const char **errmsg)
+{
+    struct ecat_master *master;
+
+#if !MT
+    /* Note that ecs_setup_master() sets tid to ~0U! */
+    if (tid < ecat_data.nst)
+        tid = ecat_data.st[tid] / ecat_data.st[0];
+#endif
+
+    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+
+        if (master->id == master_id) {
+
+            if (master->fastest_tid > tid) {
+                master->fastest_tid = tid;
+                master->tid_trigger = master->fastest_tid;
+            }
+
+            return master;
+        }
+    }
+
+    master = calloc(1, sizeof(struct ecat_master));
+    master->id = master_id;
+    master->io_mode = ECS_IO_DEFAULT;
+    master->fastest_tid = tid;
+    master->tid_trigger = tid;
+    master->calib.cycles = ecat_data.calibrate;
+    INIT_LIST_HEAD(&master->domain_list);
+    list_add_tail(&master->list, &ecat_data.master_list);
+
+    master->handle = ecrt_request_master(master_id);
+
+    if (!master->handle) {
+        snprintf(errbuf, sizeof(errbuf),
+                "ecrt_request_master(%u) failed", master_id);
+        *errmsg = errbuf;
+        return NULL;
+    }
+
+    if (master_id >= ECS_MAX_MASTERS)
+        fprintf(stderr, "EtherCAT master %u: ids from %u on get no "
+                "statistics, per master options or worker CPU\n",
+                master_id, ECS_MAX_MASTERS);
+
+    return master;
+}
+
+/***************************************************************************/
+
+static struct ecat_domain *
+get_domain( struct ecat_master *master, unsigned int domain_id,
         char input, char output, unsigned int tid, const char **errmsg)
 {
     struct ecat_domain *domain;
@@ -1026,7 +2791,7 @@ init_slave(const struct ec_slave *slave)
     struct ecat_domain *domain;
     ec_slave_config_t *slave_config;
     const struct sdo_config *sdo;
-    const struct ec_slave_sdo *sdo_req;
+    struct ec_slave_sdo *sdo_req;
     const struct soe_config *soe;
     const char *failed_method;
 
@@ -1210,52 +2975,274 @@ init_slave(const struct ec_slave *slave)
         if (!domain)
             return err;
 
-        if ((err = register_pdos(slave_config, domain, 1,
-                        slave->pdo_map + slave->rxpdo_count,
-                        slave->txpdo_count)))
-            return err;
+        if ((err = register_pdos(slave_config, domain, 1,
+                        slave->pdo_map + slave->rxpdo_count,
+                        slave->txpdo_count)))
+            return err;
+    }
+
+    list_for_each(sdo_req, &ec_slave_sdo_head, struct ec_slave_sdo) {
+        if (sdo_req->master != slave->master
+                || sdo_req->alias != slave->alias
+                || sdo_req->position != slave->position)
+            continue;
+
+        sdo_req->request =
+            ecrt_slave_config_create_sdo_request(slave_config, 0, 0, sdo_req->len);
+        *sdo_req->addr = sdo_req->request;
+    }
+
+    return NULL;
+
+out_slave_failed:
+    snprintf(errbuf, sizeof(errbuf),
+            "%s() failed while configuring slave %u:%u",
+            failed_method, slave->alias, slave->position);
+    return errbuf;
+}
+
+/***************************************************************************/
+int ecs_sdo_handler(
+        unsigned int master_id,
+        unsigned int alias,
+        unsigned int position,
+        unsigned int len,
+        void **addr)
+{
+    struct ec_slave_sdo *s;
+
+    /* After a restart of the model, hand out the request created at the
+     * first start again */
+    if (ecat_data.active) {
+        list_for_each(s, &ec_slave_sdo_head, struct ec_slave_sdo) {
+            if (s->master == master_id && s->alias == alias
+                    && s->position == position && s->len == len
+                    && s->addr == addr) {
+                *addr = s->request;
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    s = malloc(sizeof(struct ec_slave_sdo));
+
+    if (!s)
+        return 1;
+
+    s->master = master_id;
+    s->alias = alias;
+    s->position = position;
+    s->len = len;
+    s->addr = addr;
+    s->request = NULL;
+
+    list_add_tail(&s->list, &ec_slave_sdo_head);
+    return 0;
+}
+
+/***************************************************************************/
+
+/* Returns the value of option if its name is name, otherwise NULL.
+ * The value of an option without one is "" */
+static const char *
+option_value(const char *option, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (strncmp(option, name, len))
+        return NULL;
+
+    if (option[len] == '=')
+        return option + len + 1;
+
+    return option[len] ? NULL : option + len;
+}
+
+/* Parse a comma separated list of at most n numbers less than max.
+ * Returns the count of numbers, or -1 on error */
+static int
+option_list(const char *value, int *list, unsigned int n, long max)
+{
+    unsigned int count = 0;
+
+    while (*value) {
+        char *end;
+        long x = strtol(value, &end, 10);
+
+        if (end == value || x < 0 || x >= max
+                || (*end && *end != ',') || count == n)
+            return -1;
+
+        list[count++] = x;
+        value = *end ? end + 1 : end;
+    }
+
+    return count;
+}
+
+/* Set the I/O mode option of the masters in the list value, or of all
+ * masters if the list is empty */
+static int
+option_io_mode(const char *value, unsigned int io_mode)
+{
+    int list[ECS_MAX_MASTERS];
+    int i, n = option_list(value, list, ECS_MAX_MASTERS, ECS_MAX_MASTERS);
+
+    if (n < 0)
+        return -1;
+
+    if (!n)
+        memset(ecat_data.io_mode, io_mode + 1, sizeof(ecat_data.io_mode));
+
+    for (i = 0; i < n; i++)
+        ecat_data.io_mode[list[i]] = io_mode + 1;
+
+    return 0;
+}
+
+/* Set an option given as "name[=value]" */
+const char *
+ecs_set_option(const char *option)
+{
+    const char *value;
+    int n;
+
+    if ((value = option_value(option, "workers"))) {
+        n = option_list(value, ecat_data.worker_cpu,
+                ECS_MAX_MASTERS, CPU_SETSIZE);
+        if (n < 0)
+            goto invalid;
+
+        ecat_data.workers = 1;
+        ecat_data.worker_cpu_count = n;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "worker-priority"))) {
+        if (option_list(value, &ecat_data.worker_priority, 1,
+                    sched_get_priority_max(SCHED_FIFO) + 1) != 1)
+            goto invalid;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "synchronous"))) {
+        if (option_io_mode(value, ECS_IO_SYNC))
+            goto invalid;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "pipelined"))) {
+        if (option_io_mode(value, ECS_IO_PIPELINED))
+            goto invalid;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "turnaround"))) {
+        if (option_io_mode(value, ECS_IO_TURNAROUND))
+            goto invalid;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "release"))) {
+        int us;
+
+        if (option_list(value, &us, 1, 1000000) != 1)
+            goto invalid;
+
+        ecat_data.release = us * 1000U;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "calibrate"))) {
+        int cycles;
+
+        if (option_list(value, &cycles, 1, INT_MAX) != 1 || !cycles)
+            goto invalid;
+
+        ecat_data.calibrate = cycles;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "calibrate-margin"))) {
+        int us;
+
+        if (option_list(value, &us, 1, 1000000) != 1)
+            goto invalid;
+
+        ecat_data.calibrate_margin = us * 1000U;
+        return NULL;
+    }
+
+    if ((value = option_value(option, "bus-clock"))) {
+        int master_id = 0;
+
+        if (*value && option_list(value, &master_id, 1, INT_MAX) != 1)
+            goto invalid;
+
+        ecat_data.bus_clock = master_id + 1;
+        return NULL;
     }
 
-    list_for_each(sdo_req, &ec_slave_sdo_head, struct ec_slave_sdo) {
-        if (sdo_req->master != slave->master
-                || sdo_req->alias != slave->alias
-                || sdo_req->position != slave->position)
-            continue;
+    if ((value = option_value(option, "turnaround-deadline"))) {
+        int us;
 
-        *sdo_req->addr =
-            ecrt_slave_config_create_sdo_request(slave_config, 0, 0, sdo_req->len);
+        if (option_list(value, &us, 1, 1000000) != 1 || !us)
+            goto invalid;
+
+        ecat_data.turnaround_deadline = us * 1000U;
+        return NULL;
     }
 
-    return NULL;
+    snprintf(errbuf, sizeof(errbuf), "Unknown option '%s'", option);
+    return errbuf;
 
-out_slave_failed:
-    snprintf(errbuf, sizeof(errbuf),
-            "%s() failed while configuring slave %u:%u",
-            failed_method, slave->alias, slave->position);
+invalid:
+    snprintf(errbuf, sizeof(errbuf), "Invalid option '%s'", option);
     return errbuf;
 }
 
 /***************************************************************************/
-int ecs_sdo_handler(
-        unsigned int master_id,
-        unsigned int alias,
-        unsigned int position,
-        unsigned int len,
-        void **addr)
+
+const char *
+ecs_register_statistics(struct pdtask *pdtask)
 {
-    struct ec_slave_sdo *s = malloc(sizeof(struct ec_slave_sdo));
+    static const size_t dim[] = {ECS_MAX_MASTERS};
+    static const struct {
+        const char *path;
+        const double *addr;
+    } signal[] = {
+        {"/Taskinfo/EtherCAT/ReceiveTime", ecat_stats.receive_time},
+        {"/Taskinfo/EtherCAT/SendTime",    ecat_stats.send_time},
+        {"/Taskinfo/EtherCAT/SendOffset",  ecat_stats.send_offset},
+        {"/Taskinfo/EtherCAT/SendJitter",  ecat_stats.send_jitter},
+        {"/Taskinfo/EtherCAT/RoundTrip",   ecat_stats.round_trip},
+        {"/Taskinfo/EtherCAT/PollCount",   ecat_stats.poll_count},
+        {"/Taskinfo/EtherCAT/ReleaseOverruns", ecat_stats.release_overruns},
+        {"/Taskinfo/EtherCAT/ShiftTime",   ecat_stats.shift_time},
+        {"/Taskinfo/EtherCAT/PhaseError",  ecat_stats.phase_error},
+        {"/Taskinfo/EtherCAT/ClockCorrection", ecat_stats.clock_correction},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(signal) / sizeof(signal[0]); i++) {
+        if (!pdserv_signal(pdtask, 1, signal[i].path, pd_double_T,
+                    signal[i].addr, 1, dim)) {
+            snprintf(errbuf, sizeof(errbuf),
+                    "Registering signal %s failed", signal[i].path);
+            return errbuf;
+        }
+    }
 
-    if (!s)
-        return 1;
+    return NULL;
+}
 
-    s->master = master_id;
-    s->alias = alias;
-    s->position = position;
-    s->len = len;
-    s->addr = addr;
+/***************************************************************************/
 
-    list_add_tail(&s->list, &ec_slave_sdo_head);
-    return 0;
+int64_t
+ecs_clock_offset(void)
+{
+    return __atomic_load_n(&ecat_data.clock_offset, __ATOMIC_RELAXED);
 }
 
 /***************************************************************************/
@@ -1277,6 +3264,244 @@ const char *ecs_init(
 
 /***************************************************************************/
 
+/* Number of dispatch tables */
+static unsigned int
+task_count(void)
+{
+#if MT
+    return ecat_data.nst;
+#else
+    return 1;
+#endif
+}
+
+/***************************************************************************/
+
+uint64_t
+ecs_io_time(unsigned int tid)
+{
+    if (!ecat_data.task || tid >= task_count())
+        return 0;
+
+    return ecat_data.task[tid].io_time;
+}
+
+/***************************************************************************/
+
+/* Returns 1 if the domain is serviced by task tid */
+static int
+task_has_domain(const struct ecat_domain *domain, unsigned int tid)
+{
+#if MT
+    /* Either the task's own domain, or a proxy for a remote domain */
+    return domain->tid == tid || domain->master->fastest_tid == tid;
+#else
+    (void)domain;
+    return !tid;
+#endif
+}
+
+/***************************************************************************/
+
+/* Period of the fastest task using the master in ns */
+static unsigned int
+master_period(const struct ecat_master *master)
+{
+#if MT
+    return ecat_data.st[master->fastest_tid];
+#else
+    /* fastest_tid is the decimation of the base rate */
+    return ecat_data.st[0] * master->fastest_tid;
+#endif
+}
+
+/***************************************************************************/
+
+/* Rework the master and domain lists into the dispatch tables */
+static const char *
+build_task_tables(void)
+{
+    struct ecat_master *master;
+    struct ecat_domain *domain;
+    unsigned int tid, ntask = task_count();
+
+    ecat_data.task = calloc(ntask, sizeof(struct ecat_task));
+    if (!ecat_data.task)
+        return no_mem_msg;
+
+    for (tid = 0; tid < ntask; tid++) {
+        struct ecat_task *task = ecat_data.task + tid;
+        struct task_master *m;
+        struct task_domain *d;
+        size_t master_count = 0, domain_count = 0;
+
+        list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+            size_t n = 0;
+
+            list_for_each(domain, &master->domain_list, struct ecat_domain)
+                n += task_has_domain(domain, tid);
+
+            master_count += n > 0;
+            domain_count += n;
+        }
+
+        /* Masters and domains of a task share one block of memory */
+        m = calloc(1, master_count * sizeof(*m) + domain_count * sizeof(*d));
+        if (!m && master_count)
+            return no_mem_msg;
+
+        task->master = task->master_end = m;
+        d = (struct task_domain *)(m + master_count);
+
+        list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+            struct task_domain *domain_start = d;
+
+            list_for_each(domain, &master->domain_list, struct ecat_domain) {
+                if (!task_has_domain(domain, tid))
+                    continue;
+
+                d->handle = domain->handle;
+                d->state = &domain->state;
+                d->input_plan = domain->input_plan;
+                d->output_plan = domain->output_plan;
+                d->input_list =
+                    domain->input ? domain->input_convert_list : NULL;
+                d->output_list =
+                    domain->output ? domain->output_convert_list : NULL;
+#if MT
+                d->io_state = &domain->io_state;
+                if (master->fastest_tid != tid)
+                    d->mode = DOMAIN_REMOTE;
+                else if (domain->tid != tid) {
+                    d->mode = DOMAIN_PROXY;
+                    d->input_list = d->output_list = NULL;
+                }
+                else
+                    d->mode = DOMAIN_LOCAL;
+#else
+                d->tid = domain->tid;
+                d->tid_trigger = domain->tid_trigger;
+#endif
+                d++;
+            }
+
+            /* Masters without domains in this task are left out. They
+             * have no space in the table */
+            if (d == domain_start)
+                continue;
+
+            m = task->master_end;
+            m->domain = domain_start;
+            m->domain_end = d;
+            m->handle = master->handle;
+            m->master = master;
+            m->owner = master->fastest_tid == tid;
+            m->stats = master->id < ECS_MAX_MASTERS ? (int)master->id : -1;
+            m->io_mode = master->io_mode;
+            if (master->id < ECS_MAX_MASTERS && ecat_data.io_mode[master->id])
+                m->io_mode = ecat_data.io_mode[master->id] - 1;
+#if MT
+            m->timeout = master_period(master);
+#else
+            m->fastest_tid = master->fastest_tid;
+            m->tid_trigger = master->tid_trigger;
+#endif
+
+            /* Poll a domain that is sent every cycle of the master */
+            for (d = domain_start; d != m->domain_end; d++) {
+#if MT
+                if (d->mode == DOMAIN_LOCAL) {
+#else
+                if (d->tid == m->fastest_tid) {
+#endif
+                    m->poll = d;
+                    break;
+                }
+            }
+            d = m->domain_end;
+
+            if (ecat_data.bus_clock == master->id + 1) {
+                if (!master->refclk_trigger_init) {
+                    snprintf(errbuf, sizeof(errbuf),
+                            "Bus clock master %u does not use "
+                            "distributed clocks", master->id);
+                    return errbuf;
+                }
+#if MT
+                m->bus_clock = m->owner;
+#else
+                m->bus_clock = 1;
+#endif
+                master->pll.period = master_period(master);
+            }
+
+            m->deadline = ecat_data.turnaround_deadline
+                ? ecat_data.turnaround_deadline
+                : master_period(master) / 2;
+
+            if (m->io_mode == ECS_IO_SYNC && ecat_data.release) {
+                if (ecat_data.release >= master_period(master)) {
+                    snprintf(errbuf, sizeof(errbuf),
+                            "Release time %uus is not within the period "
+                            "of master %u", ecat_data.release / 1000,
+                            master->id);
+                    return errbuf;
+                }
+                m->release = ecat_data.release;
+            }
+            task->master_end++;
+        }
+    }
+
+    return NULL;
+}
+
+/***************************************************************************/
+
+/* Restart of the model: the masters stay active with the configuration of
+ * the first start. The slave structures of the model are static, so every
+ * PDO entry still holds its domain and offset from then. Only the
+ * conversion lists are rebuilt, binding the entries to the model again */
+static const char *
+restart_slaves(const struct ec_slave *slave_head)
+{
+    const struct ec_slave *slave;
+    struct ecat_master *master;
+    struct ecat_domain *domain;
+    const struct pdo_map *pdo_map;
+
+    for (slave = slave_head; slave; slave = slave->next) {
+        for (pdo_map = slave->pdo_map; pdo_map != slave->pdo_map
+                + slave->rxpdo_count + slave->txpdo_count; pdo_map++) {
+            if (!pdo_map->domain) {
+                snprintf(errbuf, sizeof(errbuf),
+                        "Slave %u:%u was not configured at the start",
+                        slave->alias, slave->position);
+                return errbuf;
+            }
+        }
+    }
+
+    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+        list_for_each(domain, &master->domain_list, struct ecat_domain) {
+            free_plan(domain->input_plan);
+            free_plan(domain->output_plan);
+            domain->input_plan = domain->output_plan = NULL;
+
+            domain->input_count = 0;
+            domain->output_count = 0;
+#if MT
+            /* A task may have stopped in the middle of a hand over */
+            domain->io_state = DOMAIN_IO_IDLE;
+#endif
+        }
+    }
+
+    return NULL;
+}
+
+/***************************************************************************/
+
 const char * ecs_start_slaves(
         const struct ec_slave *slave_head
         )
@@ -1285,6 +3510,12 @@ const char * ecs_start_slaves(
     const struct ec_slave *slave;
     struct ecat_master *master;
 
+    if (ecat_data.active) {
+        if ((err = restart_slaves(slave_head)))
+            goto out;
+        goto convert;
+    }
+
     for (slave = slave_head; slave; slave = slave->next) {
     pr_debug("init: %i\n", __LINE__);
         if ((err = init_slave(slave)))
@@ -1318,7 +3549,9 @@ const char * ecs_start_slaves(
             domain->output_count = 0;
         }
     }
+    ecat_data.active = 1;
 
+convert:
     for (slave = slave_head; slave; slave = slave->next) {
         struct pdo_map *pdo_map = slave->pdo_map;
         struct pdo_map *pdo_map_end = slave->pdo_map + slave->rxpdo_count;
@@ -1333,7 +3566,13 @@ const char * ecs_start_slaves(
             convert->src = pdo_map->address;
             convert->dst = pdo_map->domain->io_data + pdo_map->offset;
 
-            if (pdo_map->datatype < 1008) {
+            if (pdo_map->scale.type && pdo_map->datatype % 1000 >= 8) {
+                /* scaled analog values */
+                init_scale(pdo_map);
+                convert->copy = ecs_write_scaled;
+                convert->map = pdo_map;
+            }
+            else if (pdo_map->datatype < 1008) {
                 /* bit operations */
                 static void (* const convert_funcs[])(
 				const struct endian_convert_t *) = {
@@ -1387,7 +3626,12 @@ const char * ecs_start_slaves(
             convert->dst = pdo_map->address;
             convert->src = pdo_map->domain->io_data + pdo_map->offset;
 
-            if (pdo_map->datatype < 1008) {
+            if (pdo_map->scale.type && pdo_map->datatype % 1000 >= 8) {
+                init_scale(pdo_map);
+                convert->copy = ecs_read_scaled;
+                convert->map = pdo_map;
+            }
+            else if (pdo_map->datatype < 1008) {
                 static void (* const convert_funcs[])(
 				const struct endian_convert_t *) = {
                     ecs_read_uint1, ecs_read_uint2,
@@ -1426,6 +3670,27 @@ const char * ecs_start_slaves(
         }
     }
 
+#if ECS_CONVERT_PLAN
+    /* Compile the conversion lists into plans */
+    select_bit_kernels();
+    list_for_each(master, &ecat_data.master_list, struct ecat_master) {
+        struct ecat_domain *domain;
+
+        list_for_each(domain, &master->domain_list, struct ecat_domain) {
+            domain->input_plan = compile_plan(domain->input_convert_list,
+                    domain->input_count, 1);
+            domain->output_plan = compile_plan(domain->output_convert_list,
+                    domain->output_count, 0);
+        }
+    }
+#endif
+
+    if ((err = build_task_tables()))
+        goto out;
+
+    if (ecat_data.workers)
+        start_workers(ecat_data.task);
+
     return NULL;
 
 out:
@@ -1437,14 +3702,26 @@ out:
 
 void ecs_end(size_t nst)
 {
+    struct ecat_task *task;
+
     (void)nst;
+
+    stop_workers();
+
+    if (!ecat_data.task)
+        return;
+
+    for (task = ecat_data.task; task != ecat_data.task + task_count(); task++)
+        free(task->master);
+    free(ecat_data.task);
+    ecat_data.task = NULL;
 }
 
 /***************************************************************************/
 
 const char *
 ecs_setup_master( unsigned int master_id,
-        unsigned int refclk_sync_dec, void **master_p)
+        unsigned int refclk_sync_dec, unsigned int io_mode, void **master_p)
 {
     const char *errmsg;
     /* Get the master structure, making sure not to change the task it
@@ -1459,6 +3736,7 @@ ecs_setup_master( unsigned int master_id,
 
     master->refclk_trigger_init = refclk_sync_dec;
     master->refclk_trigger = 1;
+    master->io_mode = io_mode;
 
     return NULL;
 }
@@ -1483,7 +3761,7 @@ ecs_get_domain_ptr(unsigned int master_id, unsigned int domain_id,
 
 #if TESTDTYPES
 /* Compile with
- * gcc -DTESTDTYPES=1 -I../../include -o ecrt ecrt_support.c -lethercat -pthread
+ * gcc -DTESTDTYPES=1 -I../../include -o ecrt ecrt_support.c -lethercat -lpdserv -pthread
  */
 
 #include <assert.h>
@@ -1660,5 +3938,398 @@ int main(int argc, char** argv)
         ecs_write_le_double(&table); assert(dst != val);
     }
 
+    {
+        /* Scaled int16 inputs, the last one with its own gain, and
+         * saturated int16 outputs */
+        uint8_t io[16], io_list[16];
+        double in[6], in_list[6], out[2] = {0.5, -2.0};
+        double gain = 10.0;
+        struct pdo_map map[8];
+        struct endian_convert_t list[7], list_out[3];
+        struct plan_step *plan, *plan_out;
+        size_t i;
+
+        memset(map, 0, sizeof(map));
+        for (i = 0; i < sizeof(io); i++)
+            io[i] = 0x35 * i + 0x8c;
+
+        for (i = 0; i < 8; i++) {
+            map[i].datatype = 2016;
+            map[i].scale.type = PDO_SCALE_DOUBLE;
+            map[i].scale.full_scale = 32768.0;
+            map[i].scale.gain_addr = &gain;
+            map[i].scale.offset = 1.0;
+            init_scale(map + i);
+        }
+        map[5].scale.gain_addr = &map[5].scale.gain;
+        map[5].scale.gain = 3.0;
+
+        memset(list, 0, sizeof(list));
+        memset(list_out, 0, sizeof(list_out));
+        for (i = 0; i < 6; i++) {
+            list[i].copy = ecs_read_scaled;
+            list[i].src = io + 2*i;
+            list[i].dst = in + i;
+            list[i].map = map + i;
+        }
+        for (i = 0; i < 2; i++) {
+            list_out[i].copy = ecs_write_scaled;
+            list_out[i].src = out + i;
+            list_out[i].dst = io + 12 + 2*i;
+            list_out[i].map = map + 6 + i;
+        }
+
+        plan = compile_plan(list, 6, 1);
+        plan_out = compile_plan(list_out, 2, 0);
+        assert(plan && plan[0].op == PLAN_SCALE_IN && plan[0].count == 6);
+        assert(!plan[0].list->index && plan[1].op == PLAN_END);
+        assert(plan_out && plan_out[0].op == PLAN_SCALE_OUT);
+        assert(plan_out[0].list->index && plan_out[0].count == 2);
+
+        convert(NULL, list);
+        memcpy(in_list, in, sizeof(in));
+        memset(in, 0, sizeof(in));
+        convert(plan, list);
+        assert(!memcmp(in, in_list, sizeof(in)));
+        assert(in[0] == (int16_t)le16toh(*(uint16_t*)io) * 10.0/32768.0 + 1.0);
+
+        /* (0.5 * 10 + 1) * 32768 and (-2.0 * 10 + 1) * 32768 saturate */
+        convert(NULL, list_out);
+        memcpy(io_list, io, sizeof(io));
+        memset(io + 12, 0, 4);
+        convert(plan_out, list_out);
+        assert(!memcmp(io, io_list, sizeof(io)));
+        assert((int16_t)le16toh(*(uint16_t*)(io + 12)) == 32767);
+        assert((int16_t)le16toh(*(uint16_t*)(io + 14)) == -32768);
+    }
+
+    {
+        /* Saturation of 64 bit integers and NaN */
+        struct pdo_map map;
+        int64_t i64;
+        uint64_t u64;
+        int16_t i16;
+        double v = 0.0;
+
+        memset(&map, 0, sizeof(map));
+        map.datatype = 2064;
+        pdo_set_value(&map, (uint8_t*)&i64, 1e30);
+        assert(le64toh(i64) == INT64_MAX - 1023);
+        pdo_set_value(&map, (uint8_t*)&i64, -1e30);
+        assert(le64toh(i64) == INT64_MIN);
+        pdo_set_value(&map, (uint8_t*)&i64, NAN);
+        assert(!i64);
+
+        map.datatype = 1064;
+        pdo_set_value(&map, (uint8_t*)&u64, 1e30);
+        assert(le64toh(u64) == UINT64_MAX - 2047);
+        pdo_set_value(&map, (uint8_t*)&u64, -1.0);
+        assert(!u64);
+
+        map.datatype = 2016;
+        v = NAN;
+        encode_values((uint8_t*)&i16, &map, &v, 1);
+        assert(!i16);
+    }
+
+    {
+        /* 26 boolean inputs and outputs, bits 3..28 */
+        uint8_t io[6], io_list[6];
+        uint8_t bits[26], bits_list[26];
+        struct endian_convert_t list[27], list_out[27];
+        struct plan_step *plan, *plan_out;
+        size_t i, kernel;
+
+        for (i = 0; i < sizeof(io); i++)
+            io[i] = 0x5a ^ (0x37 * i);
+        for (i = 0; i < 26; i++) {
+            list[i].copy = ecs_read_uint1;
+            list[i].src = io + (i + 3) / 8;
+            list[i].dst = bits + i;
+            list[i].index = (i + 3) % 8;
+
+            list_out[i].copy = ecs_write_uint1;
+            list_out[i].src = bits + i;
+            list_out[i].dst = io + (i + 3) / 8;
+            list_out[i].index = (i + 3) % 8;
+        }
+        list[26].copy = list_out[26].copy = NULL;
+
+        plan = compile_plan(list, 26, 1);
+        plan_out = compile_plan(list_out, 26, 0);
+        assert(plan && plan[0].op == PLAN_UNPACK && plan[0].count == 26);
+        assert(plan_out && plan_out[0].op == PLAN_PACK);
+        assert(plan[1].op == PLAN_END && plan_out[1].op == PLAN_END);
+
+        for (kernel = 0; kernel < 2; kernel++) {
+            if (kernel)
+                select_bit_kernels();
+
+            convert(NULL, list);
+            memcpy(bits_list, bits, sizeof(bits));
+            memset(bits, 0xff, sizeof(bits));
+            convert(plan, list);
+            assert(!memcmp(bits, bits_list, sizeof(bits)));
+
+            for (i = 0; i < sizeof(bits); i++)
+                bits[i] = (i * 7) % 3 == 1;
+            convert(NULL, list_out);
+            memcpy(io_list, io, sizeof(io));
+            memset(io + 1, 0, 2);
+            io[0] ^= 0xf8;
+            io[3] ^= 0x1f;
+            convert(plan_out, list_out);
+            assert(!memcmp(io, io_list, sizeof(io)));
+        }
+    }
+
+    {
+        uint8_t io[16];
+        struct {
+            uint16_t a[2];
+            uint32_t b;
+            uint16_t c[2];
+            uint8_t bit;
+        } plan_val, list_val;
+        struct endian_convert_t list[] = {
+            {ecs_read_le_uint16, &list_val.a[1], io + 2, 0},
+            {ecs_read_le_uint16, &list_val.a[0], io + 0, 0},
+            {ecs_read_be_uint16, &list_val.c[1], io + 10, 0},
+            {ecs_read_uint1,     &list_val.bit,  io + 12, 3},
+            {ecs_read_le_uint32, &list_val.b,    io + 4, 0},
+            {ecs_read_be_uint16, &list_val.c[0], io + 8, 0},
+            {NULL,},
+        };
+        const size_t count = sizeof(list)/sizeof(list[0]) - 1;
+        struct plan_step *plan;
+        size_t i;
+
+        for (i = 0; i < sizeof(io); i++)
+            io[i] = 0x11 * i + 0x08;
+
+        memset(&list_val, 0, sizeof(list_val));
+        convert(NULL, list);
+
+        /* Point the list to plan_val and compile */
+        for (i = 0; i < count; i++)
+            list[i].dst = (uint8_t*)list[i].dst
+                - (uint8_t*)&list_val + (uint8_t*)&plan_val;
+        plan = compile_plan(list, count, 1);
+        assert(plan);
+
+        memset(&plan_val, 0, sizeof(plan_val));
+        convert(plan, list);
+        assert(!memcmp(&plan_val, &list_val, sizeof(plan_val)));
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        /* a[] and b merged into one block, c[] swapped in one run */
+        assert(plan[0].op == PLAN_COPY && plan[0].list->index == 8);
+        assert(plan[1].op == PLAN_SWAP16 && plan[1].count == 2);
+        assert(plan[2].op == PLAN_UNPACK && plan[2].count == 1);
+        assert(plan[3].op == PLAN_END);
+#endif
+    }
+
+}
+#endif
+
+/***************************************************************************/
+
+#if ECS_BENCHMARK
+/* Stress benchmark of the multi-tasking I/O path: 4 tasks with the rates
+ * 1:2:4:8 each have a domain on 4 masters. The cyclic ecrt_*() functions
+ * are replaced by stubs busy waiting a few microseconds, the model by a
+ * busy wait of a varying length. The worst case and mean time from the
+ * task's wakeup until ecs_send() returns are reported for every task,
+ * and the worst case send jitter for every master.
+ *
+ * Compile with
+ * gcc -DMT=1 -DECS_BENCHMARK=1 -O2 -I../../include -o ecs_benchmark \
+ *      ecrt_support.c -lethercat -lpdserv -pthread
+ * and run as root to get SCHED_FIFO priorities:
+ * ecs_benchmark [base period in us] [seconds] [option ...]
+ * where the options are passed to ecs_set_option(), e.g. "pipelined"
+ */
+
+#include <sched.h>
+
+#define BENCH_TASKS     4
+#define BENCH_MASTERS   4
+
+pthread_key_t monotonic_time_key;
+pthread_key_t tid_key;
+
+static unsigned int bench_period;       /* Base period in ns */
+static unsigned int bench_cycles;       /* Number of base periods */
+static struct timespec bench_start;
+
+static struct bench_stats {
+    uint64_t max;
+    uint64_t sum;
+    unsigned int count;
+} bench_stats[BENCH_TASKS];
+
+static double bench_send_jitter[BENCH_MASTERS];
+
+int ETL_is_major_step(void)
+{
+    return 1;
+}
+
+static uint64_t
+bench_now(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return ETL_TIMESPEC2NANO(tp);
+}
+
+static void
+bench_busy(unsigned int ns)
+{
+    uint64_t end = bench_now() + ns;
+
+    while (bench_now() < end)
+        ;
+}
+
+/* Cyclic functions of the master library */
+ec_master_t *ecrt_request_master(unsigned int idx)
+{
+    return (ec_master_t *)calloc(1, 64);
+}
+
+ec_domain_t *ecrt_master_create_domain(ec_master_t *master)
+{
+    return (ec_domain_t *)calloc(1, 64);
+}
+
+int ecrt_master_activate(ec_master_t *master)
+{
+    return 0;
+}
+
+uint8_t *ecrt_domain_data(ec_domain_t *domain)
+{
+    return (uint8_t *)domain;
+}
+
+void ecrt_master_receive(ec_master_t *master)   { bench_busy(10000); }
+void ecrt_master_send(ec_master_t *master)      { bench_busy(10000); }
+void ecrt_domain_process(ec_domain_t *domain)   { bench_busy(2000); }
+void ecrt_domain_queue(ec_domain_t *domain)     { bench_busy(2000); }
+void ecrt_master_state(const ec_master_t *master, ec_master_state_t *state) {}
+void ecrt_domain_state(const ec_domain_t *domain, ec_domain_state_t *state) {}
+void ecrt_master_application_time(ec_master_t *master, uint64_t time) {}
+void ecrt_master_sync_slave_clocks(ec_master_t *master) {}
+
+static void *
+bench_task(void *arg)
+{
+    unsigned int tid = (uintptr_t)arg;
+    unsigned int decimation = 1U << tid;
+    struct bench_stats *stats = bench_stats + tid;
+    struct sched_param param = { .sched_priority = 80 - tid };
+    struct timespec t = bench_start;
+    unsigned int cycle;
+
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+        fprintf(stderr, "Task %u: SCHED_FIFO not available\n", tid);
+    pthread_setspecific(tid_key, &tid);
+    pthread_setspecific(monotonic_time_key, &t);
+
+    for (cycle = 0; cycle < bench_cycles; cycle += decimation) {
+        uint64_t start, dt;
+
+        t.tv_nsec += decimation * bench_period;
+        while (t.tv_nsec >= 1000000000) {
+            t.tv_nsec -= 1000000000;
+            t.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+
+        start = ETL_TIMESPEC2NANO(t);
+        ecs_receive();
+        bench_busy((cycle / decimation % 4) * bench_period / 16);
+        ecs_send();
+        dt = bench_now() - start;
+
+        if (!tid) {
+            unsigned int master;
+
+            for (master = 0; master < BENCH_MASTERS; master++)
+                if (ecat_stats.send_jitter[master]
+                        > bench_send_jitter[master])
+                    bench_send_jitter[master] =
+                        ecat_stats.send_jitter[master];
+        }
+
+        stats->sum += dt;
+        stats->count++;
+        if (dt > stats->max)
+            stats->max = dt;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    static unsigned int st[BENCH_TASKS + 1];
+    pthread_t thread[BENCH_TASKS];
+    const char *err;
+    unsigned int tid, master;
+    int i;
+
+    bench_period = (argc > 1 ? atoi(argv[1]) : 1000) * 1000;
+    bench_cycles = (argc > 2 ? atoi(argv[2]) : 5) * 1000000000ULL
+        / bench_period;
+
+    for (tid = 0; tid < BENCH_TASKS; tid++)
+        st[tid] = bench_period << tid;
+
+    pthread_key_create(&tid_key, NULL);
+    pthread_key_create(&monotonic_time_key, NULL);
+
+    for (i = 3; i < argc; i++)
+        if ((err = ecs_set_option(argv[i]))) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+
+    ecs_init(st, BENCH_TASKS, 0);
+    for (master = 0; master < BENCH_MASTERS; master++)
+        for (tid = 0; tid < BENCH_TASKS; tid++)
+            if (!ecs_get_domain_ptr(master, 0, 1, 1, tid, &err)) {
+                fprintf(stderr, "%s\n", err);
+                return 1;
+            }
+    if ((err = ecs_start_slaves(NULL))) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+    bench_start.tv_sec++;
+    for (tid = 0; tid < BENCH_TASKS; tid++)
+        pthread_create(thread + tid, NULL, bench_task, (void*)(uintptr_t)tid);
+    for (tid = 0; tid < BENCH_TASKS; tid++)
+        pthread_join(thread[tid], NULL);
+
+    printf("tid  period/us  cycles  mean/us   max/us\n");
+    for (tid = 0; tid < BENCH_TASKS; tid++)
+        printf("%3u %10u %7u %8.1f %8.1f\n", tid, st[tid] / 1000,
+                bench_stats[tid].count,
+                bench_stats[tid].sum / 1e3 / bench_stats[tid].count,
+                bench_stats[tid].max / 1e3);
+
+    printf("master  send jitter max/us\n");
+    for (master = 0; master < BENCH_MASTERS; master++)
+        printf("%6u %8.1f\n", master, bench_send_jitter[master] * 1e6);
+
+    ecs_end(BENCH_TASKS);
+
+    return 0;
 }
 #endif
@@ -19,7 +19,8 @@
 #define RESET              mxGetScalar(ssGetSFcnParam(S,2))
 #define REFCLOCK_DEC       mxGetScalar(ssGetSFcnParam(S,3))
 #define TSAMPLE            mxGetScalar(ssGetSFcnParam(S,4))
-#define PARAM_COUNT                                     5
+#define IO_MODE            mxGetScalar(ssGetSFcnParam(S,5))
+#define PARAM_COUNT                                     6
 
 
 /*====================*
@@ -111,11 +112,14 @@ static void mdlRTW(SimStruct *S)
 {
     int32_T master = MASTER;
     uint32_T refclock_dec = REFCLOCK_DEC >= 1.0 ? REFCLOCK_DEC : 0;
+    uint32_T io_mode = IO_MODE >= 1.0 ? IO_MODE - 1 : 0; /* popup index */
 
     if (!ssWriteRTWScalarParam(S, "MasterId", &master, SS_INT32))
         return;
     if (!ssWriteRTWScalarParam(S, "RefClkSyncDec", &refclock_dec, SS_UINT32))
         return;
+    if (!ssWriteRTWScalarParam(S, "IoMode", &io_mode, SS_UINT32))
+        return;
     if (!ssWriteRTWWorkVect(S, "PWork", 1, "MasterPtr", 1))
         return;
 
@@ -0,0 +1,121 @@
+/*
+ * $Id$
+ *
+ * SFunction to run function-call subsystems in parallel
+ *
+ * Every element of the output is a function-call that triggers one
+ * partition, an atomic function-call subsystem. In the generated code,
+ * the partitions are dispatched to the partition workers of the
+ * application and joined before the block returns, see etl_fork_join()
+ * in hrt_main.c. The partitions must be independent of each other and
+ * must not contain EtherCAT blocks. In simulation, they run one after
+ * the other.
+ *
+ * License: GPLv3+
+ */
+
+#define S_FUNCTION_NAME  fork_join
+#define S_FUNCTION_LEVEL 2
+
+#include "simstruc.h"
+
+#define COUNT             ((int_T)mxGetScalar(ssGetSFcnParam(S,0)))
+#define TSAMPLE           (mxGetScalar(ssGetSFcnParam(S,1)))
+#define PARAM_COUNT                                     2
+
+
+/*====================*
+ * S-function methods *
+ *====================*/
+
+/* Function: mdlInitializeSizes ===============================================
+ * Abstract:
+ *    The sizes information is used by Simulink to determine the S-function
+ *    block's characteristics (number of inputs, outputs, states, etc.).
+ */
+static void mdlInitializeSizes(SimStruct *S)
+{
+    uint_T i;
+
+    ssSetNumSFcnParams(S, PARAM_COUNT);  /* Number of expected parameters */
+    if (ssGetNumSFcnParams(S) != ssGetSFcnParamsCount(S)) {
+        /* Return if number of expected != number of actual parameters */
+        return;
+    }
+    for( i = 0; i < PARAM_COUNT; i++)
+        ssSetSFcnParamTunable(S,i,SS_PRM_NOT_TUNABLE);
+
+    if (COUNT < 1) {
+        ssSetErrorStatus(S, "Partition count must be positive");
+        return;
+    }
+
+    if (!ssSetNumInputPorts(S, 0)) return;
+
+    if (!ssSetNumOutputPorts(S, 1)) return;
+    ssSetOutputPortWidth(S, 0, COUNT);
+    ssSetOutputPortDataType(S, 0, SS_FCN_CALL);
+
+    ssSetNumSampleTimes(S, 1);
+
+    ssSetOptions(S,
+            SS_OPTION_WORKS_WITH_CODE_REUSE |
+            SS_OPTION_RUNTIME_EXCEPTION_FREE_CODE);
+}
+
+/* Function: mdlInitializeSampleTimes =========================================
+ * Abstract:
+ *    This function is used to specify the sample time(s) for your
+ *    S-function. You must register the same number of sample times as
+ *    specified in ssSetNumSampleTimes.
+ */
+static void mdlInitializeSampleTimes(SimStruct *S)
+{
+    int_T i;
+
+    ssSetSampleTime(S, 0, TSAMPLE);
+    ssSetOffsetTime(S, 0, 0.0);
+
+    for (i = 0; i < COUNT; i++)
+        ssSetCallSystemOutput(S, i);
+}
+
+/* Function: mdlOutputs =======================================================
+ * Abstract:
+ *    In this function, you compute the outputs of your S-function
+ *    block. Generally outputs are placed in the input vector, ssGetY(S).
+ */
+static void mdlOutputs(SimStruct *S, int_T tid)
+{
+    int_T i;
+
+    for (i = 0; i < COUNT; i++) {
+        if (!ssCallSystemWithTid(S, i, tid))
+            return;     /* Error occurred, which will be reported */
+    }
+}
+
+/* Function: mdlTerminate =====================================================
+ * Abstract:
+ *    In this function, you should perform any actions that are necessary
+ *    at the termination of a simulation.  For example, if memory was
+ *    allocated in mdlStart, this is the place to free it.
+ */
+static void mdlTerminate(SimStruct *S)
+{
+}
+
+
+/*======================================================*
+ * See sfuntmpl_doc.c for the optional S-function methods *
+ *======================================================*/
+
+/*=============================*
+ * Required S-function trailer *
+ *=============================*/
+
+#ifdef  MATLAB_MEX_FILE    /* Is this file being compiled as a MEX-file? */
+#include "simulink.c"      /* MEX-file interface mechanism */
+#else
+#include "cg_sfun.h"       /* Code generation registration function */
+#endif
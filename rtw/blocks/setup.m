@@ -14,6 +14,7 @@ mex event.c
 mex findidx.c
 mex etl_message.c
 mex propagate_width.c
+mex fork_join.c
 
 if verLessThan('simulink', '9.0')
     system('rm *.slx');
@@ -0,0 +1,205 @@
+/* Wait strategies of the real time tasks for the start of their next cycle.
+ *
+ *   WAIT_SLEEP  clock_nanosleep() until the start.
+ *   WAIT_SPIN   clock_nanosleep() until a margin before the start, then
+ *               spin on clock_gettime(). After every sleep, the margin is
+ *               raised to the error of the sleep plus WAIT_MARGIN_GUARD if
+ *               that is more, otherwise it shrinks slowly towards it. The
+ *               task spins for the tail of the wakeup latency of the
+ *               kernel, at the cost of CPU time.
+ *   WAIT_POLL   Spin on clock_gettime() only. This keeps the CPU busy all
+ *               the time, so the task needs a CPU of its own.
+ *
+ * Comparing the wakeup latency of the strategies:
+ *   gcc -O2 -DCYCLE_WAIT_BENCHMARK -x c cycle_wait.h -o wait_benchmark
+ *   ./wait_benchmark [period_us [cycles]]
+ * Run it as root on the CPU of the task, e.g. with taskset.
+ */
+
+#ifndef CYCLE_WAIT_H
+#define CYCLE_WAIT_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum wait_strategy {
+    WAIT_SLEEP = 0,
+    WAIT_SPIN,
+    WAIT_POLL,
+};
+
+#define WAIT_MARGIN_INIT    50000       /* Initial margin [ns] */
+#define WAIT_MARGIN_MIN     2000        /* [ns] */
+#define WAIT_MARGIN_GUARD   2000        /* Margin above the sleep error [ns] */
+#define WAIT_MARGIN_DECAY   8           /* The margin shrinks by 1/2^8 of
+                                         * its excess per cycle */
+
+struct cycle_wait {
+    unsigned int strategy;      /* enum wait_strategy */
+    uint32_t margin;            /* WAIT_SPIN: current margin [ns] */
+    uint32_t margin_max;        /* Upper limit of margin [ns] */
+};
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* b - a in ns */
+static inline int64_t wait_diff_ns(const struct timespec *a,
+        const struct timespec *b)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec) * 1000000000
+        + (b->tv_nsec - a->tv_nsec);
+}
+
+/* Set up a task with the given period [ns]. The margin never exceeds
+ * half the period */
+static inline void cycle_wait_init(struct cycle_wait *w, uint32_t period)
+{
+    w->margin_max = period / 2 > WAIT_MARGIN_MIN
+        ? period / 2 : WAIT_MARGIN_MIN;
+    w->margin = WAIT_MARGIN_INIT < w->margin_max
+        ? WAIT_MARGIN_INIT : w->margin_max;
+}
+
+/* Adapt the margin to the error of the last sleep */
+static inline void cycle_wait_adapt(struct cycle_wait *w, int64_t error)
+{
+    int64_t target = error + WAIT_MARGIN_GUARD;
+
+    if (target > w->margin)
+        w->margin = target < w->margin_max ? target : w->margin_max;
+    else
+        w->margin -= (w->margin - target) >> WAIT_MARGIN_DECAY;
+
+    if (w->margin < WAIT_MARGIN_MIN)
+        w->margin = WAIT_MARGIN_MIN;
+}
+
+/* Wait until the absolute CLOCK_MONOTONIC time t. Returns 0 or the error
+ * of clock_nanosleep() */
+static inline int cycle_wait(struct cycle_wait *w, const struct timespec *t)
+{
+    struct timespec now, early;
+    int ret;
+
+    switch (w->strategy) {
+        case WAIT_SPIN:
+            early = *t;
+            early.tv_nsec -= w->margin;
+            while (early.tv_nsec < 0) {
+                early.tv_nsec += 1000000000;
+                early.tv_sec--;
+            }
+
+            /* Only a sleep that started in time tells the error */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (wait_diff_ns(&now, &early) > 0) {
+                if ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                &early, 0)))
+                    return ret;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                cycle_wait_adapt(w, wait_diff_ns(&early, &now));
+            }
+            /* fall through */
+
+        case WAIT_POLL:
+            for (;;) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                if (wait_diff_ns(&now, t) <= 0)
+                    return 0;
+                cpu_relax();
+            }
+
+        default:
+            return clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, 0);
+    }
+}
+
+#ifdef CYCLE_WAIT_BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "latency_histogram.h"
+
+/* Smallest bucket bound that at least fraction q of the values are below */
+static uint64_t quantile(const uint64_t *hist, uint64_t n, double q)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        sum += hist[i];
+        if (sum >= q * n)
+            break;
+    }
+    return hist_bucket_min(i + 1);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *name[] = {"sleep", "spin", "poll"};
+    static uint64_t hist[HIST_BUCKETS];
+    uint32_t period = 1000 * (argc > 1 ? atoi(argv[1]) : 1000);
+    unsigned int cycles = argc > 2 ? atoi(argv[2]) : 10000;
+    struct sched_param param = {
+        .sched_priority = sched_get_priority_max(SCHED_FIFO),
+    };
+    struct cycle_wait w;
+    struct timespec t, now;
+    unsigned int s, i;
+    int64_t late, max;
+
+    if (sched_setscheduler(0, SCHED_FIFO, &param))
+        fprintf(stderr, "Running without SCHED_FIFO\n");
+    mlockall(MCL_CURRENT | MCL_FUTURE);
+
+    printf("period %uus, %u cycles, wakeup latency [ns]\n",
+            period / 1000, cycles);
+    printf("%-6s %8s %8s %8s %8s %8s\n",
+            "", "p50 <", "p99 <", "p99.9 <", "max", "margin");
+
+    for (s = WAIT_SLEEP; s <= WAIT_POLL; s++) {
+        memset(hist, 0, sizeof(hist));
+        w.strategy = s;
+        cycle_wait_init(&w, period);
+        max = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        for (i = 0; i < cycles; i++) {
+            t.tv_nsec += period;
+            while (t.tv_nsec >= 1000000000) {
+                t.tv_nsec -= 1000000000;
+                t.tv_sec++;
+            }
+            if (cycle_wait(&w, &t))
+                return 1;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            late = wait_diff_ns(&t, &now);
+            hist_record(hist, late);
+            if (late > max)
+                max = late;
+        }
+
+        printf("%-6s %8llu %8llu %8llu %8lld %8u\n", name[s],
+                (unsigned long long)quantile(hist, cycles, 0.5),
+                (unsigned long long)quantile(hist, cycles, 0.99),
+                (unsigned long long)quantile(hist, cycles, 0.999),
+                (long long)max, s == WAIT_SPIN ? w.margin : 0);
+    }
+
+    return 0;
+}
+
+#endif  /* CYCLE_WAIT_BENCHMARK */
+
+#endif  /* CYCLE_WAIT_H */
@@ -17,6 +17,37 @@ struct pdo_map {
     struct ecat_domain *domain;
     int offset;
     unsigned int bit_pos;
+
+    /* Optional fused scaling, generated when EtherCATFusedScaling is set.
+     * If scale.type is set, address points to the block signal
+     * instead of to a DWork holding the raw PDO value, and the support
+     * layer does the scaling in the same pass as the conversion:
+     *   TxPdo:  signal = pdo / full_scale * gain + offset
+     *   RxPdo:  pdo = saturate((signal * gain + offset) * full_scale)
+     * Tunable gain and offset are read through gain_addr and offset_addr,
+     * otherwise the constants gain and offset are used */
+    struct {
+        unsigned int type;      /* enum pdo_scale_type */
+        double full_scale;      /* 0.0 is the same as 1.0 */
+        double gain;
+        double offset;
+        const double *gain_addr;
+        const double *offset_addr;
+    } scale;
+};
+
+/* Data type of a scaled signal, see struct pdo_map::scale */
+enum pdo_scale_type {
+    PDO_SCALE_NONE = 0,
+    PDO_SCALE_DOUBLE,           /* real_T */
+    PDO_SCALE_SINGLE,           /* real32_T */
+};
+
+/* I/O mode of a master, see ecs_setup_master() */
+enum ecs_io_mode {
+    ECS_IO_SYNC = 0,
+    ECS_IO_PIPELINED,
+    ECS_IO_TURNAROUND,
 };
 
 /* Structure to temporarily store SDO objects prior to registration */
@@ -73,6 +104,88 @@ struct ec_slave {
 void ecs_send(void);
 void ecs_receive(void);
 
+/* Set an option of the support layer, given as "name[=value]".
+ * Must be called before ecs_init(). Options:
+ *   workers[=cpu,...]  Service the masters of the base task using one
+ *                      real time thread per master. The n-th CPU listed
+ *                      is the one the thread of master n is pinned to.
+ *                      The threads are created by ecs_start_slaves() and
+ *                      spin between the cycles, so their CPUs should be
+ *                      isolated.
+ *   worker-priority=n  SCHED_FIFO priority of the worker threads, set by
+ *                      the application to that of the base task. Default:
+ *                      inherited from the caller of ecs_start_slaves().
+ *   synchronous[=master,...]
+ *   pipelined[=master,...]
+ *   turnaround[=master,...]
+ *                      Override the I/O mode of the listed masters, or of
+ *                      all masters, see ecs_setup_master().
+ *   release=us         Synchronous mode: send the outputs at a fixed
+ *                      time after the wakeup of the task instead of as
+ *                      soon as the model is computed. Late outputs are
+ *                      sent at once and counted as release overrun.
+ *   turnaround-deadline=us
+ *                      Maximum time to poll for the frames in turnaround
+ *                      mode. Default: half the period of the master.
+ *   calibrate=N        Measure the send offset and the bus round trip of
+ *                      every master over N cycles, and log the smallest
+ *                      safe SYNC0 shift time: the maximum offset plus the
+ *                      maximum round trip plus a margin. Outside turnaround
+ *                      mode, ecs_send() busy polls for the frames after
+ *                      sending during these N cycles. This adds the round
+ *                      trip, or the turnaround-deadline if a frame is
+ *                      lost, to the execution time of the task owning the
+ *                      master, and keeps its CPU busy meanwhile.
+ *   calibrate-margin=us
+ *                      Margin of the calibration. Default: 10us.
+ *                      The result is also published in the statistic
+ *                      ShiftTime. It takes effect when the model is
+ *                      rebuilt with it.
+ *   bus-clock[=master] Bus clock mode: use the reference clock of the
+ *                      master, default 0, as the master clock instead of
+ *                      synchronizing it to the host. A PI controller locks
+ *                      the wakeup of the tasks to the reference clock,
+ *                      see ecs_clock_offset(). The master must use
+ *                      distributed clocks.
+ * Returns an error message or NULL */
+const char *ecs_set_option(const char *option);
+
+/* Register the timing statistics of the support layer as signals of the
+ * base task. The masters are not known yet when PdServ is prepared, so
+ * every statistic is a vector indexed by the master id. Masters with an
+ * id of ECS_MAX_MASTERS (8) or above are left out, as they are of the
+ * per master options:
+ *   /Taskinfo/EtherCAT/ReceiveTime   Receive and input conversion [s]
+ *   /Taskinfo/EtherCAT/SendTime      Output conversion and send [s]
+ *   /Taskinfo/EtherCAT/SendOffset    Task wakeup until sent [s]
+ *   /Taskinfo/EtherCAT/SendJitter    Change of SendOffset since the
+ *                                    previous send [s]
+ *   /Taskinfo/EtherCAT/RoundTrip     Turnaround mode: send until the
+ *                                    frames returned or the deadline [s]
+ *   /Taskinfo/EtherCAT/PollCount     Turnaround mode: number of polls
+ *   /Taskinfo/EtherCAT/ReleaseOverruns
+ *                                    Count of outputs that were ready
+ *                                    after the release time
+ *   /Taskinfo/EtherCAT/ShiftTime     Result of the calibration [s]
+ *   /Taskinfo/EtherCAT/PhaseError    Bus clock mode: phase of the wakeup
+ *                                    relative to the reference clock [s]
+ *   /Taskinfo/EtherCAT/ClockCorrection
+ *                                    Bus clock mode: correction of the
+ *                                    wakeup in the last cycle [s]
+ * Returns an error message or NULL */
+struct pdtask;
+const char *ecs_register_statistics(struct pdtask *pdtask);
+
+/* Bus clock mode: total correction of the wakeup time of the tasks in ns.
+ * Every task adds the change since its previous cycle to the absolute
+ * time of its next wakeup, so that the tasks stay in phase with each
+ * other. Always 0 if the mode is off */
+int64_t ecs_clock_offset(void);
+
+/* Time spent in ecs_receive() and ecs_send() by task tid during its last
+ * cycle in ns, for the cycle timing statistics of the application */
+uint64_t ecs_io_time(unsigned int tid);
+
 const char *ecs_init(
         unsigned int *st,       /* List of sample times in nanoseconds */
         size_t nst,             /* Number of sample times */
@@ -82,12 +195,37 @@ const char *ecs_init(
         );
 void ecs_end(size_t nst);
 
+/* Configure the slaves, activate the masters and bind the PDOs to the
+ * model. Called again after ecs_end() when the application restarts the
+ * model, the masters stay active with the configuration of the first
+ * call and only the PDOs are bound again.
+ * Returns an error message or NULL */
 const char *ecs_start_slaves(
         const struct ec_slave *slave_head);
 
+/* Set up a master. io_mode is one of enum ecs_io_mode:
+ *   ECS_IO_SYNC:       The outputs of a cycle are sent at its end in
+ *                      ecs_send(). The output latency is less than a
+ *                      cycle, but the time of sending varies with the
+ *                      execution time of the model.
+ *   ECS_IO_PIPELINED:  The outputs of the previous cycle are sent in
+ *                      ecs_receive(), right after the inputs were
+ *                      received, so the frame is on the wire while the
+ *                      model computes. This costs one cycle of output
+ *                      latency, but sending is as punctual as the wakeup
+ *                      of the task, see the statistic SendJitter.
+ *   ECS_IO_TURNAROUND: The outputs are queued in ecs_send(), but sent
+ *                      with the next ecs_receive(), which then busy polls
+ *                      until the frames returned or the deadline passed.
+ *                      Like ECS_IO_PIPELINED, this costs one cycle of
+ *                      output latency, but the inputs of the fastest
+ *                      domains are only one bus round trip old when the
+ *                      model computes. Every poll processes a domain
+ *                      to check its working counter. */
 const char *ecs_setup_master(
         unsigned int master_id, 
         unsigned int refclk_sync_dec,
+        unsigned int io_mode,   /* enum ecs_io_mode */
         void **master);
 
 ec_domain_t *ecs_get_domain_ptr(
@@ -0,0 +1,141 @@
+/* Log-linear latency histograms of the real time tasks.
+ *
+ * A value of ns nanoseconds is counted in bucket ns if it is less than
+ * 2 * HIST_SUB. Above that, every power of two [2^e, 2^(e+1)) is split into
+ * HIST_SUB linear buckets, so that the width of a bucket is at most 1/HIST_SUB
+ * of its values. Values of 2^32 ns (4.3s) and more are counted in the last
+ * bucket.
+ *
+ * The application keeps the histograms of all tasks in a shared memory
+ * object with the layout of struct hist_shm, which other processes may map
+ * read only. Only the task writes its histograms; every counter is updated
+ * with a single store, so a reader sees each counter consistent, but not
+ * all counters of the same cycle.
+ *
+ * Measuring the cost of hist_record():
+ *   gcc -O2 -DHIST_BENCHMARK -x c latency_histogram.h -o hist_benchmark
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define HIST_MAGIC      0x54534948      /* "HIST" */
+#define HIST_VERSION    2
+
+struct hist_task {
+    uint64_t wakeup[HIST_BUCKETS];      /* Wakeup latency */
+    uint64_t exec[HIST_BUCKETS];        /* Wakeup until published */
+};
+
+struct hist_shm {
+    uint32_t magic;             /* HIST_MAGIC */
+    uint32_t version;           /* HIST_VERSION */
+    uint32_t tasks;             /* Number of tasks */
+    uint32_t buckets;           /* HIST_BUCKETS */
+    uint64_t resets;            /* Incremented when the counters are reset */
+    int32_t pid;                /* Process writing the counters */
+    uint32_t reserved;
+    struct hist_task task[];    /* Indexed by the task id */
+};
+
+/* Bucket of a value in ns */
+static inline unsigned int hist_bucket(uint64_t ns)
+{
+    unsigned int e;
+
+    if (ns < HIST_SUB)
+        return ns;
+
+    e = 63 - __builtin_clzll(ns);
+    if (e > 31)
+        return HIST_BUCKETS - 1;
+
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+        + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value of a bucket in ns */
+static inline uint64_t hist_bucket_min(unsigned int bucket)
+{
+    unsigned int e;
+
+    if (bucket < 2 * HIST_SUB)
+        return bucket;
+
+    e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + (bucket & (HIST_SUB - 1)))
+        << (e - HIST_SUB_BITS);
+}
+
+/* Count a value. There must be only one writer per histogram */
+static inline void hist_record(uint64_t *hist, uint64_t ns)
+{
+    uint64_t *count = hist + hist_bucket(ns);
+
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+#ifdef HIST_BENCHMARK
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOPS 10000000
+
+static struct hist_task hist;
+
+static uint64_t now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int main(void)
+{
+    uint64_t x = 88172645463325252ULL, v, t0, t1, empty;
+    unsigned int i;
+
+    /* Check the bounds of the buckets */
+    for (i = 1; i < HIST_BUCKETS; i++) {
+        v = hist_bucket_min(i);
+        if (v <= hist_bucket_min(i - 1) || hist_bucket(v) != i
+                || hist_bucket(v - 1) != i - 1) {
+            printf("bucket %u: bad bound %llu\n", i, (unsigned long long)v);
+            return 1;
+        }
+    }
+
+    /* Cost of the random values alone */
+    t0 = now();
+    for (i = 0; i < LOOPS; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        __asm__ volatile("" : : "r"(x));
+    }
+    t1 = now();
+    empty = t1 - t0;
+
+    /* A wakeup latency of up to 64us and an execution time of up to 1ms
+     * per cycle */
+    t0 = now();
+    for (i = 0; i < LOOPS; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        hist_record(hist.wakeup, x & 0xffff);
+        hist_record(hist.exec, (x >> 20) & 0xfffff);
+    }
+    t1 = now();
+
+    printf("%.2f ns per cycle\n", (double)(t1 - t0 - empty) / LOOPS);
+    return 0;
+}
+
+#endif  /* HIST_BENCHMARK */
+
+#endif  /* LATENCY_HISTOGRAM_H */
@@ -0,0 +1,333 @@
+/* Shadow parameters of the real time tasks (option --shadow-parameters).
+ *
+ * PdServ writes the parameters to a shadow copy, which the base task
+ * publishes into the model at the start of a cycle when no task is
+ * computing. So the tasks take no mutex, and a write of several
+ * parameters is atomic with respect to every model step. No task waits
+ * for the writer.
+ *
+ * The generated code has one set of parameters for all tasks, so it can
+ * only be published when no task computes. While a write is pending, a
+ * slower task starting a step lets the base task go first at the same
+ * tick, which takes as long as the wakeup of the base task, at most one
+ * period of the base task. On a tick where all rates are due, every
+ * slower task has finished its previous step, so the base task finds
+ * them idle. A write is thus published at
+ * the latest with the next cycle of the slowest task, unless a task
+ * overruns.
+ *
+ * When the writer is done, it puts the shadows that differ from the
+ * model on the dirty list. Only these are copied by the base task.
+ *
+ * shadow_set::word holds the state of the shadow and the number of tasks
+ * computing a step (in units of PARAM_USER):
+ *   IDLE  -> READY    writer: shadows on the dirty list
+ *   READY -> IDLE     writer: reclaim the shadow for the next write
+ *   READY -> COPY     base task: publishing, only if no task computes
+ *   COPY  -> IDLE     base task: published
+ * The base task has the highest priority, so the other tasks only wait
+ * for it if it runs on another CPU.
+ *
+ * Testing the state machine with a writer, a base task and a slower task
+ * that computes nearly all the time (needs SCHED_FIFO):
+ *   gcc -O2 -DSHADOW_TEST -x c shadow_parameters.h -o shadow_test -pthread
+ *   ./shadow_test
+ */
+
+#ifndef SHADOW_PARAMETERS_H
+#define SHADOW_PARAMETERS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#include "cycle_wait.h"         /* cpu_relax() */
+
+enum { PARAM_IDLE = 0, PARAM_READY, PARAM_COPY };
+
+#define PARAM_STATE     3       /* Mask of the state in shadow_set::word */
+#define PARAM_USER      4       /* Unit of computing tasks */
+
+struct param_shadow {
+    struct param_shadow *next;
+    struct param_shadow *dirty_next;    /* on shadow_set::dirty */
+    int dirty;
+    void *address;              /* Parameter in the model */
+    size_t size;
+    size_t offset;              /* in a recipe image */
+    char *path;
+    int data_type;
+    char data[];
+};
+
+struct shadow_set {
+    struct param_shadow *list;
+    struct param_shadow *dirty; /* Shadows to publish */
+    size_t size;                /* Sum of the sizes */
+    pthread_mutex_t lock;       /* Writers */
+    unsigned int word;          /* State, see above */
+    uint64_t base_time;         /* Last cycle of the base task [ns] */
+    uint64_t tolerance;         /* Half the period of the base task [ns],
+                                 * for the rounding of the sample times */
+};
+
+#define SHADOW_SET_INIT \
+    { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PARAM_IDLE, 0, 0 }
+
+/* Add a shadow for the parameter at address. Returns the address of the
+ * shadow to register with PdServ, or NULL on allocation failure */
+static inline void *shadow_add(struct shadow_set *s, void *address,
+        size_t size, const char *path, int data_type)
+{
+    struct param_shadow *p;
+
+    if (!(p = malloc(sizeof(*p) + size)) || !(p->path = strdup(path))) {
+        free(p);
+        return NULL;
+    }
+
+    p->address = address;
+    p->size = size;
+    p->offset = s->size;
+    p->data_type = data_type;
+    p->dirty = 0;
+    p->dirty_next = NULL;
+    s->size += size;
+    memcpy(p->data, address, size);
+    p->next = s->list;
+    s->list = p;
+
+    return p->data;
+}
+
+/* Called by the writer around writing parameters to the shadow */
+static inline void shadow_write_lock(struct shadow_set *s, int state)
+{
+    struct param_shadow *p;
+    unsigned int word;
+
+    if (!state) {
+        /* The model is not published meanwhile, see below */
+        for (p = s->list; p; p = p->next) {
+            if (p->dirty || !memcmp(p->data, p->address, p->size))
+                continue;
+            p->dirty = 1;
+            p->dirty_next = s->dirty;
+            s->dirty = p;
+        }
+
+        if (s->dirty)
+            __atomic_add_fetch(&s->word, PARAM_READY, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+
+    /* Reclaim the shadow, unless it is being published */
+    word = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+    while ((word & PARAM_STATE) != PARAM_IDLE) {
+        if ((word & PARAM_STATE) == PARAM_COPY) {
+            sched_yield();
+            word = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+        }
+        else
+            __atomic_compare_exchange_n(&s->word, &word,
+                    word - PARAM_READY, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Start of a model step of the cycle starting at time [ns] */
+static inline void shadow_enter(struct shadow_set *s, int base_task,
+        uint64_t time)
+{
+    struct param_shadow *p;
+    struct timespec now;
+    uint64_t limit;
+    unsigned int word;
+
+    if (base_task) {
+        word = PARAM_READY;
+        if (__atomic_compare_exchange_n(&s->word, &word,
+                    PARAM_COPY + PARAM_USER, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            for (p = s->dirty; p; p = p->dirty_next) {
+                memcpy(p->address, p->data, p->size);
+                p->dirty = 0;
+            }
+            s->dirty = NULL;
+
+            __atomic_store_n(&s->base_time, time, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&s->word, PARAM_COPY, __ATOMIC_RELEASE);
+            return;
+        }
+
+        __atomic_store_n(&s->base_time, time, __ATOMIC_RELEASE);
+    }
+    else if ((__atomic_load_n(&s->word, __ATOMIC_ACQUIRE) & PARAM_STATE)
+            == PARAM_READY) {
+        /* With a write pending, the base task goes first at this tick.
+         * It is waited for at most one of its periods, in case it is
+         * late or on another clock (external trigger) */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        limit = now.tv_sec * 1000000000ULL + now.tv_nsec + 2 * s->tolerance;
+        while ((__atomic_load_n(&s->word, __ATOMIC_ACQUIRE) & PARAM_STATE)
+                == PARAM_READY
+                && (int64_t)(time - __atomic_load_n(&s->base_time,
+                        __ATOMIC_ACQUIRE)) > (int64_t)s->tolerance) {
+            cpu_relax();
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec * 1000000000ULL + now.tv_nsec > limit)
+                break;
+        }
+    }
+
+    word = __atomic_add_fetch(&s->word, PARAM_USER, __ATOMIC_ACQUIRE);
+    while ((word & PARAM_STATE) == PARAM_COPY)
+        word = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+}
+
+/* End of a model step */
+static inline void shadow_leave(struct shadow_set *s)
+{
+    __atomic_sub_fetch(&s->word, PARAM_USER, __ATOMIC_RELEASE);
+}
+
+#ifdef SHADOW_TEST
+
+#include <assert.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define TEST_WRITES     200
+#define TEST_BASE_NS    100000  /* Period of the base task */
+#define TEST_SLOW_NS    5000000 /* Period of the slower task */
+#define TEST_STEP_NS    4800000 /* Step of the slower task */
+
+static struct shadow_set test_set = SHADOW_SET_INIT;
+static double test_param[2];
+static unsigned int test_stop;
+static struct timespec test_start;
+static int64_t test_wait_ns;    /* Longest shadow_enter() of slow task */
+
+static int64_t test_ns(const struct timespec *t)
+{
+    return (t->tv_sec - test_start.tv_sec) * 1000000000LL
+        + t->tv_nsec - test_start.tv_nsec;
+}
+
+static void test_sleep(struct timespec *t, unsigned int ns)
+{
+    t->tv_nsec += ns;
+    while (t->tv_nsec >= 1000000000) {
+        t->tv_nsec -= 1000000000;
+        t->tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+/* The parameters must not change during a step */
+static void *test_task(void *arg)
+{
+    const int base_task = !arg;
+    struct timespec t = test_start, now, step;
+    struct sched_param param = { .sched_priority = base_task ? 2 : 1 };
+    int64_t ns;
+    double value;
+
+    /* As in hrt_main.c, the base task has the highest priority */
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+        perror("pthread_setschedparam");
+
+    while (!__atomic_load_n(&test_stop, __ATOMIC_RELAXED)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = test_ns(&now);
+        shadow_enter(&test_set, base_task, test_ns(&t));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = test_ns(&now) - ns;
+        if (!base_task && ns > test_wait_ns)
+            test_wait_ns = ns;
+
+        value = test_param[0];
+        assert(test_param[1] == value);
+        if (!base_task) {
+            step = t;
+            test_sleep(&step, TEST_STEP_NS);
+        }
+        assert(test_param[0] == value && test_param[1] == value);
+
+        shadow_leave(&test_set);
+        test_sleep(&t, base_task ? TEST_BASE_NS : TEST_SLOW_NS);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    struct timespec start, end, delay = {0, 100000};
+    pthread_t thread[2];
+    double *shadow[2], *unchanged;
+    int64_t ns, max_ns = 0;
+    unsigned int i;
+
+    /* Only changed shadows are published; this one would fault */
+    unchanged = mmap(NULL, sizeof(double), PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(unchanged != MAP_FAILED);
+    assert(shadow_add(&test_set, unchanged, sizeof(double), "/Test", 0));
+    for (i = 0; i < 2; i++)
+        assert((shadow[i] = shadow_add(&test_set, test_param + i,
+                        sizeof(double), "/Test", 0)));
+    test_set.tolerance = TEST_BASE_NS / 2;
+
+    clock_gettime(CLOCK_MONOTONIC, &test_start);
+    for (i = 0; i < 2; i++)
+        pthread_create(thread + i, NULL, test_task, (void*)(uintptr_t)i);
+
+    /* Write both parameters in one write, slowly */
+    for (i = 1; i <= TEST_WRITES; i++) {
+        shadow_write_lock(&test_set, 1);
+        *shadow[0] = i;
+        nanosleep(&delay, NULL);
+        *shadow[1] = i;
+        shadow_write_lock(&test_set, 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (__atomic_load_n(&test_set.word, __ATOMIC_ACQUIRE)
+                & PARAM_STATE)
+            nanosleep(&delay, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        assert(test_param[0] == i && test_param[1] == i);
+        ns = (end.tv_sec - start.tv_sec) * 1000000000LL
+            + end.tv_nsec - start.tv_nsec;
+        if (ns > max_ns)
+            max_ns = ns;
+    }
+
+    __atomic_store_n(&test_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < 2; i++)
+        pthread_join(thread[i], NULL);
+
+    printf("%u writes, longest publish %.3f ms, "
+            "longest wait of the slower task %.3f ms\n",
+            TEST_WRITES, 1.0e-6 * max_ns, 1.0e-6 * test_wait_ns);
+
+    /* The bounds plus some scheduling latency. The slower task only waits
+     * for the wakeup of the base task, never for the writer */
+    assert(max_ns < 2 * (TEST_SLOW_NS + TEST_BASE_NS));
+    assert(test_wait_ns < 10 * TEST_BASE_NS);
+
+    return 0;
+}
+
+#endif  /* SHADOW_TEST */
+
+#endif  /* SHADOW_PARAMETERS_H */
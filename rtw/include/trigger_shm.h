@@ -0,0 +1,25 @@
+/* Shared memory object of an external trigger, see the options --trigger
+ * and --trigger-out of the application.
+ *
+ * The first process to open the object creates it with the size of
+ * struct trigger_shm and stamps TRIGGER_MAGIC. An existing object of
+ * another size or magic is not a trigger and is refused.
+ *
+ * To trigger, write the time of CLOCK_MONOTONIC to time, increment seq
+ * and wake the (shared) futex waiters on seq.
+ */
+
+#ifndef TRIGGER_SHM_H
+#define TRIGGER_SHM_H
+
+#include <stdint.h>
+
+#define TRIGGER_MAGIC   0x47495254      /* "TRIG" */
+
+struct trigger_shm {
+    uint32_t magic;             /* TRIGGER_MAGIC, 0 while being created */
+    uint32_t seq;               /* Futex, incremented on every trigger */
+    int64_t time;               /* Time of the last trigger [ns] */
+};
+
+#endif  /* TRIGGER_SHM_H */
@@ -114,11 +114,17 @@
  *
  ****************************************************************************/
 
+#define _GNU_SOURCE     /* CPU_SET(), pthread_attr_setaffinity_np() */
+
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>      // sched_yield(), sched_setaffinity()
 #include <sys/mman.h>
+#include <sys/syscall.h>    // SYS_sched_setattr, SYS_futex
+#include <linux/futex.h>
+#include <poll.h>       // ppoll()
 #include <getopt.h>
 #include <libgen.h> // basename()
 #include <errno.h>
@@ -130,14 +136,22 @@
 #include <stdlib.h>     // calloc()
 #include <alloca.h>     // alloca()
 #include <string.h>
+#include <limits.h>     // PATH_MAX
+#include <math.h>       // trunc()
+#include <float.h>      // FLT_MAX
 #include <dlfcn.h>
 #include <syslog.h>
+#include <signal.h>     // kill()
 
 #include <pdserv.h>
 
 #include "rtmodel.h"
 #include "rtwtypes.h"
 #include "rt_sim.h"
+#include "latency_histogram.h"
+#include "cycle_wait.h"
+#include "trigger_shm.h"
+#include "shadow_parameters.h"
 
 #ifdef PDSERV_VERSION_CODE
 #    if PDSERV_VERSION_CODE >= PDSERV_VERSION(3,1,1)
@@ -213,6 +227,17 @@ struct pdserv *get_pdserv_ptr(void)
 
 extern int MdlRegisterMessages(void);
 
+/* Optional functions of the EtherCAT support layer. They are only
+ * available if the model uses EtherCAT */
+extern const char *ecs_set_option(const char *option)
+    __attribute__((weak));
+extern const char *ecs_register_statistics(struct pdtask *pdtask)
+    __attribute__((weak));
+extern int64_t ecs_clock_offset(void)
+    __attribute__((weak));
+extern uint64_t ecs_io_time(unsigned int tid)
+    __attribute__((weak));
+
 #if CLASSIC_INTERFACE
 
 #define RT_MODEL        CONCAT(MODEL, _rtModel)
@@ -262,6 +287,38 @@ extern void rt_ODEUpdateContinuousStates(RTWSolverInfo *si);
 #endif
 
 
+/* Phases of a cycle, see struct cycle_timing */
+enum cycle_phase {
+    PHASE_WAKEUP = 0,   /* Scheduled wakeup until running */
+    PHASE_LOCK,         /* Parameter lock */
+    PHASE_IO,           /* EtherCAT in ecs_receive() and ecs_send() */
+    PHASE_COMPUTE,      /* Model step without EtherCAT */
+    PHASE_PUBLISH,      /* pdserv_update() */
+    PHASE_COUNT
+};
+
+/* Overrun causes, see handle_overrun() */
+enum overrun_cause {
+    CAUSE_WAKEUP = 0,   /* Late wakeup */
+    CAUSE_COMPUTE,      /* Long computation, including lock and publish */
+    CAUSE_IO,           /* EtherCAT stall */
+    CAUSE_COUNT
+};
+
+/* Timing of the phases of a cycle. Every TIMING_WINDOW cycles, the
+ * minimum, maximum and mean of a phase in the window are exported as
+ * /Taskinfo/<tid>/<phase> = [min max mean] in seconds */
+#define TIMING_WINDOW 1000
+
+struct cycle_timing {
+    uint64_t last[PHASE_COUNT];         /* Last cycle in ns */
+    uint64_t min[PHASE_COUNT];          /* Window in progress */
+    uint64_t max[PHASE_COUNT];
+    uint64_t sum[PHASE_COUNT];
+    unsigned int count;
+    double stats[PHASE_COUNT][3];       /* Exported */
+};
+
 /* See comment at the top of the file for registering new data types */
 struct compound_desc {
     const char   *fieldName;
@@ -288,6 +345,21 @@ char *pdserv_config = NULL; /**< Path to PdServ configuration file. */
 bool daemonize = false; /**< Become a daemon. */
 const char *pidPath = ""; /**< Path of PID file (empty for no PID file). */
 int phase = -1;      /**< Phase to start task 0..100 */
+bool shadow_parameters = false; /**< Write parameters to a shadow copy. */
+bool chained = false; /**< Task 0 releases the other tasks. */
+const char *trigger_in = NULL; /**< Trigger of task 0, "fd:N"/"shm:NAME". */
+const char *trigger_out = NULL; /**< Trigger fired after every step. */
+unsigned int trigger_timeout = 0; /**< Clock fallback [us], 0 for none. */
+bool virtual_time = false; /**< Run as fast as possible on a virtual clock. */
+double virtual_duration = 0.0; /**< Virtual time to run [s], 0 for no end. */
+unsigned int restart_max = 0; /**< Restarts of the model after an error. */
+const char *recipe_dir = NULL; /**< Directory of parameter recipes. */
+const char *histogram_shm = NULL; /**< Shared memory of the histograms. */
+cpu_set_t housekeeping_cpus; /**< CPUs of the PdServ threads, if any. */
+cpu_set_t partition_cpus; /**< CPUs of the partition workers, if any. */
+int cpu_latency = 0; /**< CPU wakeup latency [us], negative to leave it. */
+
+static cpu_set_t default_cpus; /* Affinity of the process at start */
 
 static void *exe;      /* Pointer to this executable. */
 
@@ -307,12 +379,125 @@ struct thread_task {
     struct timespec world_time;
     pthread_t thread;
     pthread_mutex_t param_lock;
+    unsigned int signal_seq;    /* Odd while the task updates its signals,
+                                 * see signal_write_begin() */
+#ifdef SYSTEM_LOCKING
     pthread_rwlock_t signal_lock;
+#endif
+
+    unsigned int overrun_policy;        /* enum overrun_policy */
+    struct cycle_wait wait;     /* Wait strategy for the next cycle */
+    struct {                    /* Chained mode, see chain_wait() */
+        unsigned int seq;       /* Futex, incremented on every release */
+        uint64_t due;           /* Wakeup time [ns] while waiting, else 0 */
+        unsigned int idle;      /* Futex, set while waiting or stopped */
+    } chain;
+    unsigned int sched_policy;  /* Index of sched_policy[] */
+    int sched_priority;         /* 0: priority - tid */
+    cpu_set_t cpus;             /* CPU affinity, empty for the default */
+    struct {                    /* SCHED_DEADLINE, see deadline_cycle() */
+        unsigned int state;     /* enum deadline_state */
+        uint32_t runtime;       /* Budget [ns], 0 to measure it */
+        uint32_t max_exec;      /* Longest cycle while measuring [ns] */
+        unsigned int cycles;    /* Cycles measured */
+    } deadline;
+    unsigned int degrade;       /* Degrade policy: the task runs every
+                                 * 2^degrade cycles */
+    unsigned int on_time;       /* Cycles on time since the last change of
+                                 * degrade */
+    struct {                    /* Exported to PdServ */
+        uint32_t consecutive;   /* Consecutive overruns */
+        uint32_t caught_up;     /* Cycles started late */
+        uint32_t skipped;       /* Cycles left out */
+        uint32_t degraded;      /* Cycles run with degrade > 0 */
+        uint32_t cause[CAUSE_COUNT];    /* enum overrun_cause */
+        uint32_t budget;        /* Cycles longer than the deadline budget */
+    } overrun;
+    struct cycle_timing timing;
+    struct hist_task *hist;     /* Latency histograms */
+    uint64_t hist_resets;       /* Value of hist->resets when last reset */
     const char* (*rt_OneStep)(uint_T);
 };
 
 pthread_key_t monotonic_time_key;
 
+/****************************************************************************/
+
+/* Signal publication (seqlock): the task makes signal_seq odd while it
+ * computes and publishes its signals, and even again when done. It never
+ * waits for a reader. A reader copies while the sequence is even, and
+ * retries if it changed in the meantime.
+ *
+ * With SYSTEM_LOCKING, PdServ reads the signals in place between two
+ * calls of read_signal_lock() and cannot retry. Nor can it read from a
+ * snapshot, because pdserv_update() reads the same registered addresses
+ * in the task. So this path keeps the rwlock, preferring the writer, and
+ * a reader can still delay the task.
+ */
+static inline void signal_write_begin(struct thread_task *thread)
+{
+#ifdef SYSTEM_LOCKING
+    pthread_rwlock_wrlock(&thread->signal_lock);
+#else
+    __atomic_store_n(&thread->signal_seq, thread->signal_seq + 1,
+            __ATOMIC_RELAXED);
+    /* The updates must not be seen before the odd sequence */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+}
+
+static inline void signal_write_end(struct thread_task *thread)
+{
+#ifdef SYSTEM_LOCKING
+    pthread_rwlock_unlock(&thread->signal_lock);
+#else
+    __atomic_store_n(&thread->signal_seq, thread->signal_seq + 1,
+            __ATOMIC_RELEASE);
+#endif
+}
+
+/* Wait until the task is not updating its signals. Returns the sequence
+ * to pass to signal_read_retry() */
+static inline unsigned int signal_read_begin(const struct thread_task *thread)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&thread->signal_seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+
+    return seq;
+}
+
+/* Returns true if the signals were updated while reading them */
+static inline int signal_read_retry(const struct thread_task *thread,
+        unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&thread->signal_seq, __ATOMIC_RELAXED) != seq;
+}
+
+/****************************************************************************/
+
+static long futex(unsigned int *addr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/****************************************************************************/
+
+/* Shadow parameters (option --shadow-parameters), see
+ * shadow_parameters.h */
+static struct shadow_set shadows = SHADOW_SET_INIT;
+
+/* Returns the address of a parameter to register with PdServ, or NULL
+ * on allocation failure */
+static void *shadow_parameter(void *address, size_t size,
+        const char *path, int data_type)
+{
+    return shadow_parameters
+        ? shadow_add(&shadows, address, size, path, data_type) : address;
+}
+
 #define NSEC_PER_SEC (1000000000)
 
 #undef timeradd
@@ -495,6 +680,1006 @@ rt_OneStepTid(uint_T tid)
 
 #endif /* MT */
 
+/****************************************************************************/
+
+/* Overrun policies (option --overrun). When a task is done only after its
+ * next wakeup time, it
+ *   catchup:   runs the missed cycles back to back, the default
+ *   skip:      leaves out the missed cycles, realigning to its grid
+ *   degrade:   runs at half its rate after every overrun, down to
+ *              1/2^OVERRUN_DEGRADE_MAX, and recovers a step after every
+ *              OVERRUN_RECOVER cycles on time. The base task skips
+ *              instead, as it cannot run slower
+ *   terminate: catches up, but stops the application after OVERRUNMAX
+ *              consecutive overruns
+ * Skipped cycles do not advance the model time of the task.
+ */
+enum overrun_policy {
+    OVERRUN_CATCHUP = 0,
+    OVERRUN_SKIP,
+    OVERRUN_DEGRADE,
+    OVERRUN_TERMINATE,
+};
+
+static const char *overrun_policy_name[] = {
+    "catchup", "skip", "degrade", "terminate", NULL
+};
+
+static const char *wait_strategy_name[] = {
+    "sleep", "spin", "poll", NULL
+};
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+static const char *sched_policy_name[] = {
+    "fifo", "rr", "other", "deadline", NULL
+};
+
+static const int sched_policy[] = {
+    SCHED_FIFO, SCHED_RR, SCHED_OTHER, SCHED_DEADLINE
+};
+
+#define OVERRUN_DEGRADE_MAX 4
+#define OVERRUN_RECOVER     100
+
+/* Handle an overrun of a task detected at the time now. The next wakeup
+ * time was advanced by a regular cycle already */
+static void handle_overrun(struct thread_task *thread,
+        const struct timespec *now, unsigned int dt)
+{
+    const uint64_t *last = thread->timing.last;
+    unsigned int policy = thread->overrun_policy;
+    long long late = DIFF_NS(thread->monotonic_time, *now);
+    unsigned int cycle;
+    uint64_t compute = last[PHASE_LOCK] + last[PHASE_COMPUTE]
+        + last[PHASE_PUBLISH];
+
+    thread->overrun.consecutive++;
+    thread->on_time = 0;
+
+    /* The cause is the phase that took the most time */
+    if (last[PHASE_WAKEUP] > compute && last[PHASE_WAKEUP] > last[PHASE_IO])
+        thread->overrun.cause[CAUSE_WAKEUP]++;
+    else if (last[PHASE_IO] > compute)
+        thread->overrun.cause[CAUSE_IO]++;
+    else
+        thread->overrun.cause[CAUSE_COMPUTE]++;
+
+    if (policy == OVERRUN_DEGRADE && thread == task)
+        policy = OVERRUN_SKIP;
+
+    switch (policy) {
+        case OVERRUN_TERMINATE:
+            if (OVERRUNMAX && thread->overrun.consecutive >= OVERRUNMAX)
+                thread->err = "Too many consecutive overruns";
+            /* fall through */
+
+        case OVERRUN_CATCHUP:
+            thread->overrun.caught_up++;
+            break;
+
+        case OVERRUN_DEGRADE:
+            if (thread->degrade < OVERRUN_DEGRADE_MAX)
+                thread->degrade++;
+            /* fall through */
+
+        case OVERRUN_SKIP:
+            cycle = dt << thread->degrade;
+            for (; late >= 0; late -= cycle) {
+                timeradd(&thread->monotonic_time, cycle);
+                thread->overrun.skipped++;
+            }
+            break;
+    }
+}
+
+/* Record the phases of a cycle */
+static void update_timing(struct cycle_timing *timing)
+{
+    unsigned int i;
+
+    for (i = 0; i < PHASE_COUNT; i++) {
+        uint64_t ns = timing->last[i];
+
+        if (!timing->count || ns < timing->min[i])
+            timing->min[i] = ns;
+        if (!timing->count || ns > timing->max[i])
+            timing->max[i] = ns;
+        timing->sum[i] = (timing->count ? timing->sum[i] : 0) + ns;
+    }
+
+    if (++timing->count < TIMING_WINDOW)
+        return;
+
+    for (i = 0; i < PHASE_COUNT; i++) {
+        timing->stats[i][0] = 1.0e-9 * timing->min[i];
+        timing->stats[i][1] = 1.0e-9 * timing->max[i];
+        timing->stats[i][2] = 1.0e-9 * timing->sum[i] / TIMING_WINDOW;
+    }
+    timing->count = 0;
+}
+
+/* Register the timing and overrun statistics of a task */
+static const char *register_task_statistics(struct thread_task *thread)
+{
+    const struct {
+        const char *name;
+        const uint32_t *addr;
+    } counter[] = {
+        {"ConsecutiveOverruns", &thread->overrun.consecutive},
+        {"CaughtUpCycles",      &thread->overrun.caught_up},
+        {"SkippedCycles",       &thread->overrun.skipped},
+        {"DegradedCycles",      &thread->overrun.degraded},
+        {"LateWakeupOverruns",  &thread->overrun.cause[CAUSE_WAKEUP]},
+        {"ComputeOverruns",     &thread->overrun.cause[CAUSE_COMPUTE]},
+        {"IoStallOverruns",     &thread->overrun.cause[CAUSE_IO]},
+        {"BudgetOverruns",      &thread->overrun.budget},
+    };
+    static const char *phase_name[PHASE_COUNT] = {
+        [PHASE_WAKEUP]  = "WakeupLatency",
+        [PHASE_LOCK]    = "LockTime",
+        [PHASE_IO]      = "IoTime",
+        [PHASE_COMPUTE] = "ComputeTime",
+        [PHASE_PUBLISH] = "PublishTime",
+    };
+    char path[64];
+    size_t i;
+
+    for (i = 0; i < sizeof(counter) / sizeof(counter[0]); i++) {
+        snprintf(path, sizeof(path), "/Taskinfo/%u/%s",
+                thread->tid, counter[i].name);
+        if (!pdserv_signal(thread->pdtask, 1, path, pd_uint32_T,
+                    counter[i].addr, 1, NULL))
+            return "Failed to register overrun statistics.";
+    }
+
+    for (i = 0; i < PHASE_COUNT; i++) {
+        snprintf(path, sizeof(path), "/Taskinfo/%u/%s",
+                thread->tid, phase_name[i]);
+        if (!pdserv_signal(thread->pdtask, 1, path, pd_double_T,
+                    thread->timing.stats[i], 3, NULL))
+            return "Failed to register timing statistics.";
+    }
+
+    return NULL;
+}
+
+/****************************************************************************/
+
+/* Latency histograms of the tasks, see latency_histogram.h. They live in
+ * the shared memory object histogram_shm if set. Writing
+ * /Taskinfo/HistogramReset makes every task clear its histograms at the
+ * start of its next cycle.
+ */
+static struct hist_shm *histograms;
+static size_t histogram_size;
+static uint32_t histogram_reset;        /* /Taskinfo/HistogramReset */
+static double histogram_bucket[HIST_BUCKETS];   /* Lower bounds [s] */
+
+/* Trigger of /Taskinfo/HistogramReset */
+static int histogram_clear(
+        const struct pdvariable* variable,
+        void *dst, const void* src, size_t len,
+        struct timespec* time,
+        void* priv_data)
+{
+    (void)variable;
+    (void)priv_data;
+
+    __atomic_add_fetch(&histograms->resets, 1, __ATOMIC_RELAXED);
+
+    memcpy(dst, src, len);
+    clock_gettime(CLOCK_REALTIME, time);
+
+    return 0;
+}
+
+/* Allocate the histograms and register them as signals of the tasks */
+/* Whether the existing object histogram_shm was left behind by a process
+ * that is gone. Objects of a running or unknown owner are not touched */
+static bool histogram_stale(void)
+{
+    const struct hist_shm *h;
+    struct stat st;
+    bool stale = false;
+    int fd;
+
+    if ((fd = shm_open(histogram_shm, O_RDONLY, 0)) == -1)
+        return errno == ENOENT;         /* Removed meanwhile */
+
+    if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(*h)
+            && (h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0))
+            != MAP_FAILED) {
+        stale = h->magic == HIST_MAGIC && h->version == HIST_VERSION
+            && h->pid > 0 && kill(h->pid, 0) == -1 && errno == ESRCH;
+        munmap((void *)h, sizeof(*h));
+    }
+    close(fd);
+
+    return stale;
+}
+
+static const char *histogram_init(struct pdserv *m_pdserv)
+{
+    char path[64];
+    unsigned int i;
+    int fd;
+
+    histogram_size = sizeof(*histograms)
+        + NUMTASKS * sizeof(histograms->task[0]);
+
+    if (histogram_shm) {
+        /* A crashed run leaves the read only object behind, which could
+         * not be opened for writing again. Another instance may use the
+         * same name, so only the object of a dead process is replaced */
+        fd = shm_open(histogram_shm, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1 && errno == EEXIST && histogram_stale()) {
+            shm_unlink(histogram_shm);
+            fd = shm_open(histogram_shm, O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+        if (fd == -1)
+            return errno == EEXIST
+                ? "The histogram shared memory exists and is not stale."
+                : "Failed to create the histogram shared memory.";
+
+        /* Readable by everyone, regardless of the umask */
+        if (!fchmod(fd, 0444) && !ftruncate(fd, histogram_size))
+            histograms = mmap(NULL, histogram_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (!histograms || histograms == MAP_FAILED) {
+            histograms = NULL;
+            shm_unlink(histogram_shm);
+            return "Failed to map the histogram shared memory.";
+        }
+    }
+    else if (!(histograms = calloc(1, histogram_size)))
+        return "No memory for histograms.";
+
+    histograms->tasks = NUMTASKS;
+    histograms->buckets = HIST_BUCKETS;
+    histograms->version = HIST_VERSION;
+    histograms->pid = getpid();
+    __atomic_store_n(&histograms->magic, HIST_MAGIC, __ATOMIC_RELEASE);
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        histogram_bucket[i] = 1.0e-9 * hist_bucket_min(i);
+
+    for (i = 0; i < NUMTASKS; i++) {
+        task[i].hist = &histograms->task[i];
+
+        snprintf(path, sizeof(path), "/Taskinfo/%u/WakeupHistogram", i);
+        if (!pdserv_signal(task[i].pdtask, 1, path, pd_uint64_T,
+                    task[i].hist->wakeup, HIST_BUCKETS, NULL))
+            return "Failed to register histograms.";
+
+        snprintf(path, sizeof(path), "/Taskinfo/%u/ExecHistogram", i);
+        if (!pdserv_signal(task[i].pdtask, 1, path, pd_uint64_T,
+                    task[i].hist->exec, HIST_BUCKETS, NULL))
+            return "Failed to register histograms.";
+    }
+
+    if (!pdserv_signal(task[0].pdtask, 1, "/Taskinfo/HistogramBuckets",
+                pd_double_T, histogram_bucket, HIST_BUCKETS, NULL)
+            || !pdserv_parameter(m_pdserv, "/Taskinfo/HistogramReset", 0666,
+                pd_uint32_T, &histogram_reset, 1, NULL,
+                histogram_clear, NULL))
+        return "Failed to register histograms.";
+
+    return NULL;
+}
+
+static void histogram_exit(void)
+{
+    if (!histograms)
+        return;
+
+    if (histogram_shm) {
+        munmap(histograms, histogram_size);
+        shm_unlink(histogram_shm);
+    }
+    else
+        free(histograms);
+    histograms = NULL;
+}
+
+/* Record the cycle in the histograms of a task. No locks, no syscalls */
+static inline void histogram_update(struct thread_task *thread,
+        uint64_t wakeup_ns, uint64_t exec_ns)
+{
+    uint64_t resets = __atomic_load_n(&histograms->resets, __ATOMIC_RELAXED);
+
+    if (resets != thread->hist_resets) {
+        memset(thread->hist, 0, sizeof(*thread->hist));
+        thread->hist_resets = resets;
+    }
+
+    hist_record(thread->hist->wakeup, wakeup_ns);
+    hist_record(thread->hist->exec, exec_ns);
+}
+
+/****************************************************************************/
+
+/* Scheduling of a task when it starts. The default is SCHED_FIFO with the
+ * priority of the application less the task id. A SCHED_DEADLINE task
+ * starts with the default and switches over in deadline_cycle() */
+static void task_scheduler(const struct thread_task *thread,
+        int *policy, struct sched_param *param)
+{
+    *policy = sched_policy[thread->sched_policy];
+    if (*policy == SCHED_DEADLINE)
+        *policy = SCHED_FIFO;
+
+    if (*policy == SCHED_OTHER)
+        param->sched_priority = 0;
+    else if (thread->sched_priority)
+        param->sched_priority = thread->sched_priority;
+    else
+        param->sched_priority = priority - thread->tid;
+}
+
+/* CPU affinity of a task */
+static const cpu_set_t *task_cpus(const struct thread_task *thread)
+{
+    return CPU_COUNT(&thread->cpus) ? &thread->cpus : &default_cpus;
+}
+
+/* Chained mode (option --chained): instead of sleeping on a timer of
+ * their own, the other tasks wait for task 0 to release them. Task 0
+ * releases a task after the step of the first tick at or past the wakeup
+ * time of the task, so the base rate step of the same tick, including
+ * its I/O, is always done before the slower task starts. A task that is
+ * late is released on the next tick. The wakeup time of a task is still
+ * its schedule, so the wakeup statistics stay per task.
+ *
+ * In virtual time (option --virtual-time), task 0 does not sleep at all.
+ * It releases the due tasks one after the other, in the order of their
+ * ids, and waits for each to finish its step (chain_join()), so that the
+ * tasks run in the same order in every run.
+ */
+
+/* Mark a task as waiting or stopped, for chain_join() */
+static void chain_park(struct thread_task *thread)
+{
+    __atomic_store_n(&thread->chain.idle, 1, __ATOMIC_RELEASE);
+    if (virtual_time)
+        futex(&thread->chain.idle, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Wait until a task waits for its release or has stopped */
+static void chain_join(struct thread_task *thread)
+{
+    while (!__atomic_load_n(&thread->chain.idle, __ATOMIC_ACQUIRE))
+        futex(&thread->chain.idle, FUTEX_WAIT_PRIVATE, 0);
+}
+
+/* Wait for the release of a task by task 0. Returns nonzero when the
+ * application stops */
+static int chain_wait(struct thread_task *thread)
+{
+    unsigned int seq = __atomic_load_n(&thread->chain.seq, __ATOMIC_ACQUIRE);
+
+    /* Task 0 stops the application before its last release */
+    if (!__atomic_load_n(thread->running, __ATOMIC_RELAXED))
+        return 1;
+
+    __atomic_store_n(&thread->chain.due,
+            TIMESPEC_TO_NS(thread->monotonic_time), __ATOMIC_RELEASE);
+    chain_park(thread);
+
+    while (__atomic_load_n(&thread->chain.seq, __ATOMIC_ACQUIRE) == seq)
+        futex(&thread->chain.seq, FUTEX_WAIT_PRIVATE, seq);
+
+    return !*thread->running;
+}
+
+static void chain_release(struct thread_task *thread)
+{
+    __atomic_store_n(&thread->chain.due, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->chain.idle, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&thread->chain.seq, 1, __ATOMIC_RELEASE);
+    futex(&thread->chain.seq, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Called by task 0 after the step of the tick at time now. Half a tick of
+ * tolerance absorbs the rounding of the sample times */
+static void chain_tick(const struct timespec *now, unsigned int dt)
+{
+    uint64_t limit = TIMESPEC_TO_NS(*now) + dt / 2, due;
+    struct thread_task *p_task;
+
+    for (p_task = task + 1; p_task < task + NUMTASKS; p_task++) {
+        if (virtual_time)
+            chain_join(p_task);
+
+        due = __atomic_load_n(&p_task->chain.due, __ATOMIC_ACQUIRE);
+        if (due && due <= limit) {
+            chain_release(p_task);
+            if (virtual_time)
+                chain_join(p_task);
+        }
+    }
+}
+
+/****************************************************************************/
+
+/* External trigger (options --trigger and --trigger-out): task 0 steps
+ * when triggered instead of on its clock, and the other tasks are chained
+ * to it. A trigger is
+ *   fd:N       an inherited eventfd, triggered by writing to it
+ *   shm:NAME   a futex in the shared memory object NAME, struct trigger_shm
+ *              in trigger_shm.h, which carries the time of the trigger
+ * The wakeup time of task 0 becomes the time of the trigger, so that its
+ * WakeupLatency is the trigger to step latency (the time it saw the
+ * trigger for fd:N). If no trigger comes within trigger_timeout after the
+ * wakeup time, task 0 falls back to its clock until the next trigger, and
+ * counts the cycles in /Taskinfo/TriggerTimeouts.
+ *
+ * With --trigger-out, task 0 fires a trigger after every step, so that two
+ * applications can run in lock step, triggering each other.
+ */
+struct trigger {
+    int fd;
+    struct trigger_shm *shm;
+    unsigned int seq;           /* shm: last seen */
+};
+
+static struct trigger trigger[2];       /* In and out */
+static bool trigger_lost;               /* Running on the clock */
+static uint32_t trigger_timeouts;
+
+/* Open a trigger */
+static const char *trigger_open(struct trigger *t, const char *spec)
+{
+    struct stat st;
+    uint32_t magic;
+    char *end;
+    int fd;
+
+    t->fd = -1;
+
+    if (!strncmp(spec, "fd:", 3)) {
+        t->fd = strtol(spec + 3, &end, 10);
+        if (end == spec + 3 || *end || fcntl(t->fd, F_GETFD) == -1)
+            return "Invalid trigger file descriptor.";
+        return NULL;
+    }
+
+    if (strncmp(spec, "shm:", 4))
+        return "Invalid trigger.";
+
+    /* Whoever comes first creates the object, see trigger_shm.h */
+    fd = shm_open(spec + 4, O_RDWR | O_CREAT, 0660);
+    if (fd == -1)
+        return "Failed to open the trigger shared memory.";
+
+    if (fstat(fd, &st)
+            || (st.st_size && (size_t)st.st_size != sizeof(*t->shm))) {
+        close(fd);
+        return "The trigger shared memory is not a trigger.";
+    }
+
+    if (!st.st_size && ftruncate(fd, sizeof(*t->shm)))
+        t->shm = MAP_FAILED;
+    else
+        t->shm = mmap(NULL, sizeof(*t->shm), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (t->shm == MAP_FAILED) {
+        t->shm = NULL;
+        return "Failed to map the trigger shared memory.";
+    }
+
+    /* An object of the size with magic 0 is being created by another
+     * process, or was just created here */
+    magic = 0;
+    if (!__atomic_compare_exchange_n(&t->shm->magic, &magic, TRIGGER_MAGIC,
+                0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+            && magic != TRIGGER_MAGIC) {
+        munmap(t->shm, sizeof(*t->shm));
+        t->shm = NULL;
+        return "The trigger shared memory is not a trigger.";
+    }
+    t->seq = __atomic_load_n(&t->shm->seq, __ATOMIC_ACQUIRE);
+
+    return NULL;
+}
+
+static const char *trigger_init(void)
+{
+    const char *err;
+
+    if ((trigger_in && (err = trigger_open(&trigger[0], trigger_in)))
+            || (trigger_out && (err = trigger_open(&trigger[1], trigger_out))))
+        return err;
+
+    if (trigger_in && !pdserv_signal(task[0].pdtask, 1,
+                "/Taskinfo/TriggerTimeouts", pd_uint32_T,
+                &trigger_timeouts, 1, NULL))
+        return "Failed to register trigger statistics.";
+
+    return NULL;
+}
+
+/* Wait until task 0 is triggered or the fallback time has come */
+static int trigger_wait(struct thread_task *thread)
+{
+    struct trigger *t = &trigger[0];
+    struct timespec deadline = thread->monotonic_time, now, timeout;
+    struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+    bool bounded = trigger_lost || trigger_timeout;
+    unsigned int seq;
+    uint64_t count;
+    int64_t ns = 0;
+    int ret;
+
+    if (!trigger_lost)
+        timeradd(&deadline, 1000 * trigger_timeout);
+
+    for (;;) {
+        if (t->shm) {
+            seq = __atomic_load_n(&t->shm->seq, __ATOMIC_ACQUIRE);
+            if (seq != t->seq) {
+                t->seq = seq;
+                ns = __atomic_load_n(&t->shm->time, __ATOMIC_RELAXED);
+                thread->monotonic_time.tv_sec = ns / NSEC_PER_SEC;
+                thread->monotonic_time.tv_nsec = ns % NSEC_PER_SEC;
+                break;
+            }
+        }
+
+        if (bounded) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ns = DIFF_NS(now, deadline);
+            if (ns <= 0) {
+                /* Fall back to the clock */
+                trigger_lost = true;
+                trigger_timeouts++;
+                thread->monotonic_time = deadline;
+                return 0;
+            }
+        }
+
+        if (t->shm) {
+            ret = syscall(SYS_futex, &t->shm->seq, FUTEX_WAIT_BITSET,
+                    t->seq, bounded ? &deadline : NULL,
+                    NULL, FUTEX_BITSET_MATCH_ANY);
+            if (ret && errno != EAGAIN && errno != ETIMEDOUT
+                    && errno != EINTR)
+                return errno;
+            continue;
+        }
+
+        timeout.tv_sec = ns / NSEC_PER_SEC;
+        timeout.tv_nsec = ns % NSEC_PER_SEC;
+        ret = ppoll(&pfd, 1, bounded ? &timeout : NULL, NULL);
+        if (ret > 0) {
+            if (read(t->fd, &count, sizeof(count)) < 0)
+                return errno;
+            clock_gettime(CLOCK_MONOTONIC, &thread->monotonic_time);
+            break;
+        }
+        if (ret < 0 && errno != EINTR)
+            return errno;
+    }
+
+    trigger_lost = false;
+    return 0;
+}
+
+/* Trigger the peer after a step of task 0 */
+static void trigger_fire(void)
+{
+    struct trigger *t = &trigger[1];
+    struct timespec now;
+    uint64_t one = 1;
+    ssize_t ret;
+
+    if (!t->shm) {
+        ret = write(t->fd, &one, sizeof(one));
+        (void)ret;      /* A full eventfd was triggered already */
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    __atomic_store_n(&t->shm->time, TIMESPEC_TO_NS(now), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->shm->seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &t->shm->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Virtual time (option --virtual-time): the tasks skip their sleep, so
+ * that monotonic_time advances by exactly one sample time per step, and
+ * world_time follows it from the time of the start. The wakeup latency is
+ * zero and there are no overruns. The statistics of the execution time
+ * still use the real clock.
+ */
+static int64_t virtual_end;             /* End of the run [ns], 0 for none */
+static int64_t virtual_offset;          /* World time - monotonic time [ns] */
+
+/* Start the virtual clock at the wakeup time of the tasks */
+static void virtual_start(const struct timespec *start)
+{
+    struct timespec world, now;
+
+    clock_gettime(CLOCK_REALTIME, &world);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    virtual_offset = DIFF_NS(now, world);
+
+    if (virtual_duration > 0.0)
+        virtual_end = TIMESPEC_TO_NS(*start)
+            + (int64_t)(virtual_duration * NSEC_PER_SEC + 0.5);
+}
+
+static void virtual_world_time(struct thread_task *thread)
+{
+    uint64_t t = TIMESPEC_TO_NS(thread->monotonic_time) + virtual_offset;
+
+    thread->world_time.tv_sec = t / NSEC_PER_SEC;
+    thread->world_time.tv_nsec = t % NSEC_PER_SEC;
+}
+
+/* Wait for the next cycle of a task */
+static int wait_cycle(struct thread_task *thread)
+{
+    if (chained && thread != task)
+        return chain_wait(thread);
+
+    if (trigger_in && thread == task)
+        return trigger_wait(thread);
+
+    /* Virtual time: step right away until virtual_duration has passed */
+    if (virtual_time)
+        return virtual_end
+            && TIMESPEC_TO_NS(thread->monotonic_time) >= virtual_end;
+
+    return cycle_wait(&thread->wait, &thread->monotonic_time);
+}
+
+/****************************************************************************/
+
+/* Fork-join partitions (block fork_join): etl_fork_join() hands all but
+ * the first partition to the partition workers, one real time thread
+ * pinned to every CPU of partition_cpus, runs the others itself and spins
+ * until the workers are done. Without workers, or while another task uses
+ * them, the partitions run one after the other. A worker spins between its
+ * jobs, so that a fork does not cost the wakeup of a thread. Its CPU is
+ * busy all the time and should not be used for anything else.
+ *
+ * With the real time throttling of the kernel (sched_rt_runtime_us not
+ * -1), a worker spinning all the time would be stopped for the rest of
+ * every second, and task 0 with it in the join. Then a worker spins only
+ * for half a period of task 0 after a job and then sleeps on a futex.
+ *
+ * For balancing, the timing of the blocks of task 0 with the ids below
+ * FORK_JOIN_MAX is exported as signals of task 0:
+ *   /Taskinfo/ForkJoin/PartitionTime   Execution time of every partition,
+ *                                      a row per block [s]
+ *   /Taskinfo/ForkJoin/JoinWait        Time the block waited for the
+ *                                      workers [s]
+ */
+#define FORK_JOIN_MAX           4
+#define FORK_JOIN_PARTITIONS    8
+
+struct partition_worker {
+    pthread_t thread;
+    unsigned int seq;           /* Incremented for every job, futex */
+    unsigned int sleeping;      /* Waiting on seq */
+    void (*job)(void);
+    void *time_key;             /* Thread specific data of the caller */
+    void *tid_key;
+    uint64_t time;              /* Execution time of the last job [ns] */
+};
+
+static struct partition_worker *partition_worker;
+static unsigned int partition_workers;
+static unsigned int partition_done;     /* Jobs finished, of the owner */
+static unsigned int partition_busy;     /* Set while a task owns them */
+static unsigned int partition_stop;
+static uint64_t partition_spin;         /* Spin window in ns, 0: always */
+static double partition_time[FORK_JOIN_MAX][FORK_JOIN_PARTITIONS];
+static double partition_join[FORK_JOIN_MAX];
+
+static void *partition_main(void *p)
+{
+    struct partition_worker *w = p;
+    struct timespec start, end;
+    unsigned int seq = 0, spin;
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        spin = 0;
+
+        while (__atomic_load_n(&w->seq, __ATOMIC_ACQUIRE) == seq) {
+            cpu_relax();
+            if (!partition_spin || ++spin % 1000)
+                continue;
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (DIFF_NS(start, end) < (int64_t)partition_spin)
+                continue;
+
+            /* See partition_release() */
+            __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&w->seq, __ATOMIC_SEQ_CST) == seq)
+                futex(&w->seq, FUTEX_WAIT_PRIVATE, seq);
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+        }
+        seq = w->seq;
+
+        if (__atomic_load_n(&partition_stop, __ATOMIC_RELAXED))
+            return NULL;
+
+        pthread_setspecific(monotonic_time_key, w->time_key);
+#if MT
+        pthread_setspecific(tid_key, w->tid_key);
+#endif
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        w->job();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        w->time = DIFF_NS(start, end);
+
+        __atomic_add_fetch(&partition_done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Hand the next job to a worker, waking it up if it sleeps */
+static void partition_release(struct partition_worker *w)
+{
+    __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+        futex(&w->seq, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* Run the partitions of block id in parallel. Called by the generated
+ * code */
+void etl_fork_join(unsigned int id, void (*const *partition)(void),
+        unsigned int count)
+{
+    struct partition_worker *w;
+    struct timespec start, end;
+    unsigned int i, n = 0;
+    int stats = id < FORK_JOIN_MAX;
+
+#if MT
+    /* The statistics are signals of task 0, only it may write them */
+    stats = stats && !*(unsigned int*)pthread_getspecific(tid_key);
+#endif
+
+    if (count > 1 && partition_workers
+            && !__atomic_exchange_n(&partition_busy, 1, __ATOMIC_ACQUIRE))
+        n = min(count - 1, partition_workers);
+
+    /* Partitions 1..n go to the workers. partition_done belongs to the
+     * owner of the workers, a task running its partitions one after the
+     * other must not touch it */
+    if (n)
+        partition_done = 0;
+    for (i = 0; i < n; i++) {
+        w = &partition_worker[i];
+        w->job = partition[i + 1];
+        w->time_key = pthread_getspecific(monotonic_time_key);
+#if MT
+        w->tid_key = pthread_getspecific(tid_key);
+#endif
+        partition_release(w);
+    }
+
+    /* The caller runs partition 0 and those left over */
+    for (i = 0; i < count; i = i ? i + 1 : n + 1) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        partition[i]();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (stats && i < FORK_JOIN_PARTITIONS)
+            partition_time[id][i] = 1.0e-9 * DIFF_NS(start, end);
+    }
+
+    /* Join, end is still the time the caller was done */
+    while (n && __atomic_load_n(&partition_done, __ATOMIC_ACQUIRE) < n)
+        cpu_relax();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (stats) {
+        partition_join[id] = 1.0e-9 * DIFF_NS(end, start);
+        for (i = 0; i < n && i + 1 < FORK_JOIN_PARTITIONS; i++)
+            partition_time[id][i + 1] = 1.0e-9 * partition_worker[i].time;
+    }
+
+    if (n)
+        __atomic_store_n(&partition_busy, 0, __ATOMIC_RELEASE);
+}
+
+static const char *partition_init(void)
+{
+    static const size_t dim[] = {FORK_JOIN_MAX, FORK_JOIN_PARTITIONS};
+
+    if (!pdserv_signal(task[0].pdtask, 1, "/Taskinfo/ForkJoin/PartitionTime",
+                pd_double_T, partition_time, 2, dim)
+            || !pdserv_signal(task[0].pdtask, 1, "/Taskinfo/ForkJoin/JoinWait",
+                pd_double_T, partition_join, FORK_JOIN_MAX, NULL))
+        return "Failed to register partition statistics.";
+
+    return NULL;
+}
+
+/* Start a worker on every CPU of partition_cpus with the scheduling of
+ * task 0 */
+static void partition_start(void)
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int policy, cpu;
+    long rt_runtime = 0;
+    FILE *f;
+
+    if (!CPU_COUNT(&partition_cpus))
+        return;
+
+    if ((f = fopen("/proc/sys/kernel/sched_rt_runtime_us", "r"))) {
+        if (fscanf(f, "%li", &rt_runtime) != 1)
+            rt_runtime = 0;
+        fclose(f);
+    }
+    if (rt_runtime != -1) {
+        partition_spin = 0.5e9 * task[0].sample_time;
+        fprintf(stderr, "Real time throttling is on (sched_rt_runtime_us "
+                "= %li): the partition workers spin for %" PRIu64 " ns "
+                "after a job and then sleep. Set it to -1 and isolate "
+                "their CPUs to let them spin.\n", rt_runtime, partition_spin);
+    }
+
+    partition_worker = calloc(CPU_COUNT(&partition_cpus),
+            sizeof(*partition_worker));
+    if (!partition_worker) {
+        fprintf(stderr, "No memory for partition workers\n");
+        return;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        struct partition_worker *w = &partition_worker[partition_workers];
+        int err;
+
+        if (!CPU_ISSET(cpu, &partition_cpus))
+            continue;
+
+        pthread_attr_init(&attr);
+        if (priority != -1) {
+            task_scheduler(task, &policy, &param);
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, policy);
+            pthread_attr_setschedparam(&attr, &param);
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+        err = pthread_create(&w->thread, &attr, partition_main, w);
+        pthread_attr_destroy(&attr);
+
+        if (err) {
+            fprintf(stderr, "Starting the partition worker on CPU %i"
+                    " failed: %s\n", cpu, strerror(err));
+            break;
+        }
+        partition_workers++;
+    }
+}
+
+static void partition_end(void)
+{
+    unsigned int i;
+
+    __atomic_store_n(&partition_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < partition_workers; i++) {
+        partition_release(&partition_worker[i]);
+        pthread_join(partition_worker[i].thread, NULL);
+    }
+
+    free(partition_worker);
+    partition_worker = NULL;
+    partition_workers = 0;
+}
+
+/****************************************************************************/
+
+/* SCHED_DEADLINE: the task measures its execution time over
+ * DEADLINE_MEASURE cycles unless the budget was given, and then reserves
+ * DEADLINE_MARGIN times the maximum for every period. The kernel refuses
+ * the reservation if it does not fit next to the other deadline tasks. */
+enum deadline_state { DEADLINE_MEASURE = 0, DEADLINE_ACTIVE, DEADLINE_OFF };
+
+#define DEADLINE_CYCLES         1000
+#define DEADLINE_MARGIN         1.25
+#define DEADLINE_RUNTIME_MIN    1024    /* ns, kernel limit */
+
+struct deadline_attr {          /* struct sched_attr of the kernel */
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+/* Switch the calling thread to SCHED_DEADLINE. Returns 0 or an errno */
+static int deadline_start(uint64_t runtime, uint64_t period)
+{
+#ifdef SYS_sched_setattr
+    struct deadline_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_DEADLINE,
+        .sched_runtime = runtime,
+        .sched_deadline = period,
+        .sched_period = period,
+    };
+
+    return syscall(SYS_sched_setattr, 0, &attr, 0) ? errno : 0;
+#else
+    (void)runtime;
+    (void)period;
+    return ENOSYS;
+#endif
+}
+
+/* Called by a SCHED_DEADLINE task after every cycle with its execution
+ * time. Cycles longer than the budget are counted as budget overruns; the
+ * kernel throttles the task until its next period */
+static void deadline_cycle(struct thread_task *thread,
+        uint32_t exec_ns, unsigned int dt)
+{
+    uint64_t runtime;
+    int err;
+
+    switch (thread->deadline.state) {
+        case DEADLINE_ACTIVE:
+            if (exec_ns > thread->deadline.runtime)
+                thread->overrun.budget++;
+            return;
+
+        case DEADLINE_MEASURE:
+            break;
+
+        default:
+            return;
+    }
+
+    if (exec_ns > thread->deadline.max_exec)
+        thread->deadline.max_exec = exec_ns;
+
+    runtime = thread->deadline.runtime;
+    if (!runtime) {
+        if (++thread->deadline.cycles < DEADLINE_CYCLES)
+            return;
+        runtime = DEADLINE_MARGIN * thread->deadline.max_exec;
+    }
+    runtime = max(runtime, DEADLINE_RUNTIME_MIN);
+    runtime = min(runtime, dt);
+
+    if ((err = deadline_start(runtime, dt))) {
+        syslog(LOG_ERR, "Task %u: SCHED_DEADLINE with runtime %" PRIu64
+                " ns, period %u ns refused: %s",
+                thread->tid, runtime, dt, strerror(err));
+        thread->deadline.state = DEADLINE_OFF;
+        return;
+    }
+
+    syslog(LOG_INFO, "Task %u: SCHED_DEADLINE with runtime %" PRIu64
+            " ns (longest cycle %u ns), period %u ns",
+            thread->tid, runtime, thread->deadline.max_exec, dt);
+    thread->deadline.runtime = runtime;
+    thread->deadline.state = DEADLINE_ACTIVE;
+}
+
+/****************************************************************************/
+
 /** Run the main task.
  */
 void *run_task(void *p)
@@ -502,12 +1687,22 @@ void *run_task(void *p)
     struct thread_task *thread = p;
     unsigned int dt = 1.0e9 * thread->sample_time + 0.5;
     uint32_t exec_ns = 0, period_ns = 0, overruns = 0;
+    int64_t clock_offset = 0, offset;
+    uint64_t *phase = thread->timing.last, io_ns;
     struct timespec start_time,
                     last_start_time = thread->monotonic_time,
-                    end_time = thread->monotonic_time;
+                    end_time = thread->monotonic_time,
+                    lock_time, step_time, publish_time;
 
     syslog(LOG_INFO, "Starting task with dt = %u ns.", dt);
 
+    cycle_wait_init(&thread->wait, dt);
+
+    /* Only the change of the offset while the task runs counts. After a
+     * restart of the model, it already holds the drift since the start */
+    if (ecs_clock_offset)
+        clock_offset = ecs_clock_offset();
+
     pthread_setspecific(monotonic_time_key, &thread->monotonic_time);
 #if MT
     pthread_setspecific(tid_key, &thread->tid);
@@ -523,15 +1718,16 @@ void *run_task(void *p)
                 " until first run (sufficiently early)!", -diff_us);
     }
 
-    while (!thread->err && *thread->running
-            && !clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-                &thread->monotonic_time, 0)) {
+    while (!thread->err && *thread->running && !wait_cycle(thread)) {
 
         clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-        pthread_rwlock_wrlock(&thread->signal_lock);
+        signal_write_begin(thread);
 
-        clock_gettime(CLOCK_REALTIME, &thread->world_time);
+        if (virtual_time)
+            virtual_world_time(thread);
+        else
+            clock_gettime(CLOCK_REALTIME, &thread->world_time);
 
 #ifdef GET_PARAMETERS
         if (thread == &task[0]) {
@@ -541,30 +1737,88 @@ void *run_task(void *p)
 #endif
 
         /* Lock parameters and execute task */
-        pthread_mutex_lock(&thread->param_lock);
+        if (shadow_parameters)
+            shadow_enter(&shadows, thread == task,
+                    TIMESPEC_TO_NS(thread->monotonic_time));
+        else
+            pthread_mutex_lock(&thread->param_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &lock_time);
         thread->err = thread->rt_OneStep(thread->sl_tid);
-        pthread_mutex_unlock(&thread->param_lock);
+        clock_gettime(CLOCK_MONOTONIC, &step_time);
+
+        if (shadow_parameters)
+            shadow_leave(&shadows);
+        else
+            pthread_mutex_unlock(&thread->param_lock);
+
+        if (chained && thread == task)
+            chain_tick(&thread->monotonic_time, dt);
+        if (trigger_out && thread == task)
+            trigger_fire();
+
         pdserv_update(thread->pdtask, &thread->world_time);
+        clock_gettime(CLOCK_MONOTONIC, &publish_time);
 
         /* Calculate timing statistics */
+        io_ns = ecs_io_time ? ecs_io_time(thread->tid) : 0;
+        phase[PHASE_WAKEUP] = virtual_time
+            ? 0 : DIFF_NS(thread->monotonic_time, start_time);
+        phase[PHASE_LOCK] = DIFF_NS(start_time, lock_time);
+        phase[PHASE_COMPUTE] = DIFF_NS(lock_time, step_time);
+        phase[PHASE_IO] = io_ns < phase[PHASE_COMPUTE]
+            ? io_ns : phase[PHASE_COMPUTE];
+        phase[PHASE_COMPUTE] -= phase[PHASE_IO];
+        phase[PHASE_PUBLISH] = DIFF_NS(step_time, publish_time);
+        update_timing(&thread->timing);
+
         period_ns = DIFF_NS(last_start_time, start_time);
-        exec_ns = DIFF_NS(last_start_time, end_time);
+        exec_ns = DIFF_NS(start_time, publish_time);
         last_start_time = start_time;
+        histogram_update(thread, phase[PHASE_WAKEUP], exec_ns);
+        if (sched_policy[thread->sched_policy] == SCHED_DEADLINE)
+            deadline_cycle(thread, exec_ns, dt);
         pdserv_update_statistics(thread->pdtask,
                 1.0e-9 * exec_ns, 1.0e-9 * period_ns, overruns);
 
-        pthread_rwlock_unlock(&thread->signal_lock);
+        signal_write_end(thread);
+
+        /* Follow the EtherCAT reference clock in bus clock mode. The
+         * correction is a small fraction of the period */
+        if (ecs_clock_offset && !virtual_time) {
+            offset = ecs_clock_offset();
+            timeradd(&thread->monotonic_time, (dt << thread->degrade)
+                    + (int)(offset - clock_offset));
+            clock_offset = offset;
+        }
+        else
+            timeradd(&thread->monotonic_time, dt << thread->degrade);
 
-        timeradd(&thread->monotonic_time, dt);
+        if (thread->degrade)
+            thread->overrun.degraded++;
 
         clock_gettime(CLOCK_MONOTONIC, &end_time);
 
-        if (DIFF_NS(end_time, thread->monotonic_time) < 0)
+        if (!virtual_time
+                && DIFF_NS(end_time, thread->monotonic_time) < 0) {
             overruns++;
+            handle_overrun(thread, &end_time, dt);
+        }
+        else {
+            thread->overrun.consecutive = 0;
+            if (thread->degrade && ++thread->on_time >= OVERRUN_RECOVER) {
+                thread->degrade--;
+                thread->on_time = 0;
+            }
+        }
     }
 
     *thread->running = 0;
 
+    /* Task 0 must not wait for a task that stopped */
+    __atomic_store_n(&thread->chain.due, 0, __ATOMIC_RELAXED);
+    chain_park(thread);
+
     return 0;
 }
 
@@ -701,6 +1955,11 @@ void write_parameter_lock(int state, void* priv_data)
     struct thread_task *p_task = task + NUMTASKS;
     (void)priv_data;
 
+    if (shadow_parameters) {
+        shadow_write_lock(&shadows, state);
+        return;
+    }
+
     if (state) {
         while (p_task != task)
             pthread_mutex_lock(&(--p_task)->param_lock);
@@ -712,13 +1971,18 @@ void write_parameter_lock(int state, void* priv_data)
 }
 
 /****************************************************************************/
+#ifdef SYSTEM_LOCKING
+/* PdServ cannot retry a read, see signal_write_begin() */
 void read_signal_lock(int state, void* priv_data)
 {
+    struct thread_task *p_task = priv_data;
+
     if (state)
-        pthread_rwlock_rdlock(priv_data);
+        pthread_rwlock_rdlock(&p_task->signal_lock);
     else
-        pthread_rwlock_unlock(priv_data);
+        pthread_rwlock_unlock(&p_task->signal_lock);
 }
+#endif
 
 /****************************************************************************/
 #ifdef VARIABLE_LOCKING
@@ -728,38 +1992,309 @@ int write_parameter(
         struct timespec* time,
         void* priv_data)
 {
-    (void)param;
+    (void)param;
+    (void)priv_data;
+
+    write_parameter_lock(1, NULL);
+    memcpy(dst, src, len);
+    write_parameter_lock(0, NULL);
+
+    clock_gettime(CLOCK_REALTIME, time);
+
+    return 0;
+}
+
+/****************************************************************************/
+
+int read_signal(
+        const struct pdvariable* signal,
+        void* dst, const void* src, size_t len,
+        struct timespec* time,
+        void* priv_data)
+{
+    (void)signal;
+    struct thread_task* task = priv_data;
+    unsigned int seq;
+
+    do {
+        seq = signal_read_begin(task);
+        memcpy(dst, src, len);
+        if (time)
+            *time = task->world_time;
+    } while (signal_read_retry(task, seq));
+
+    return 0;
+}
+#endif
+
+/****************************************************************************/
+
+/* Parameter recipes (option --recipes): a recipe is a file in recipe_dir
+ * with lines
+ *      <parameter path> <value> ...
+ * giving all values of a parameter in memory order. Parameters that are
+ * not listed keep their active value. Lines starting with '#' are
+ * comments.
+ *
+ * Writing the name of a recipe to /Recipe/Stage loads it into the staged
+ * image, which is allocated before the memory is locked. The parameters
+ * differing from the active set are logged, and counted in the signal
+ * /Recipe/Differences. Writing to /Recipe/Activate copies the staged
+ * image to the shadow parameters. The base task publishes them like a
+ * single parameter write.
+ *
+ * With VARIABLE_LOCKING, the triggers take the shadow lock themselves,
+ * otherwise PdServ holds it around them.
+ */
+#define RECIPE_NAME_MAX 64
+
+static char *recipe_image;              /* Staged recipe */
+static char recipe_staged[RECIPE_NAME_MAX + 1];   /* Name, "" if none */
+static uint8_t recipe_name[RECIPE_NAME_MAX];      /* /Recipe/Stage */
+static uint32_t recipe_activation;                /* /Recipe/Activate */
+static uint32_t recipe_differences;               /* /Recipe/Differences */
+
+/* Convert a value of a recipe to the data type of a parameter. Returns
+ * the size of the data type, 0 if it is not supported. An integer takes
+ * the value rounded towards zero. Values the data type cannot hold are
+ * not converted, and *range is cleared */
+static size_t recipe_value(void *dst, int data_type, double value,
+        int *range)
+{
+    double t = trunc(value);    /* NaN fails every comparison */
+
+    switch (data_type) {
+        case pd_boolean_T:
+            if ((*range = !isnan(value)))
+                *(uint8_t *)dst = value != 0.0;
+            return 1;
+        case pd_uint8_T:
+            if ((*range = t >= 0 && t <= UINT8_MAX))
+                *(uint8_t *)dst = t;
+            return 1;
+        case pd_sint8_T:
+            if ((*range = t >= INT8_MIN && t <= INT8_MAX))
+                *(int8_t *)dst = t;
+            return 1;
+        case pd_uint16_T:
+            if ((*range = t >= 0 && t <= UINT16_MAX))
+                *(uint16_t *)dst = t;
+            return 2;
+        case pd_sint16_T:
+            if ((*range = t >= INT16_MIN && t <= INT16_MAX))
+                *(int16_t *)dst = t;
+            return 2;
+        case pd_uint32_T:
+            if ((*range = t >= 0 && t <= UINT32_MAX))
+                *(uint32_t *)dst = t;
+            return 4;
+        case pd_sint32_T:
+            if ((*range = t >= INT32_MIN && t <= INT32_MAX))
+                *(int32_t *)dst = t;
+            return 4;
+        case pd_uint64_T:
+            if ((*range = t >= 0 && t < 0x1p64))
+                *(uint64_t *)dst = t;
+            return 8;
+        case pd_sint64_T:
+            if ((*range = t >= -0x1p63 && t < 0x1p63))
+                *(int64_t *)dst = t;
+            return 8;
+        case pd_single_T:
+            if ((*range = !isfinite(value) || fabs(value) <= FLT_MAX))
+                *(float *)dst = value;
+            return 4;
+        case pd_double_T:
+            *range = 1;
+            *(double *)dst = value;
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* Load a recipe into the staged image, based on the active parameters.
+ * Returns an error message or NULL */
+static const char *recipe_load(const char *name)
+{
+    char path[PATH_MAX];
+    char *line = NULL, *s, *end;
+    size_t len = 0, n, k;
+    unsigned int line_no = 0;
+    const char *err = NULL;
+    struct param_shadow *p;
+    int range;
+    FILE *f;
+
+    if (!*name || *name == '.' || strchr(name, '/'))
+        return "Invalid recipe name";
+
+    snprintf(path, sizeof(path), "%s/%s", recipe_dir, name);
+    if (!(f = fopen(path, "r")))
+        return strerror(errno);
+
+    for (p = shadows.list; p; p = p->next)
+        memcpy(recipe_image + p->offset, p->data, p->size);
+
+    while (!err && getline(&line, &len, f) > 0) {
+        line_no++;
+        s = line + strspn(line, " \t");
+        if (*s == '#' || *s == '\n' || !*s)
+            continue;
+
+        end = s + strcspn(s, " \t\n");
+        if (*end)
+            *end++ = '\0';
+
+        for (p = shadows.list; p && strcmp(p->path, s); p = p->next);
+        if (!p) {
+            syslog(LOG_ERR, "Recipe %s line %u: unknown parameter %s",
+                    name, line_no, s);
+            err = "Unknown parameter";
+            break;
+        }
+
+        for (n = 0, s = end; n < p->size; n += k, s = end) {
+            double value = strtod(s, &end);
+
+            if (end == s)
+                break;
+
+            if (!(k = recipe_value(recipe_image + p->offset + n,
+                            p->data_type, value, &range))) {
+                err = "Data type not supported";
+                break;
+            }
+
+            if (!range) {
+                syslog(LOG_ERR, "Recipe %s line %u: value %g out of range "
+                        "for %s", name, line_no, value, p->path);
+                err = "Value out of range";
+                break;
+            }
+        }
+
+        if (!err && (n != p->size || *(s + strspn(s, " \t\n")))) {
+            syslog(LOG_ERR, "Recipe %s line %u: wrong number of values "
+                    "for %s", name, line_no, p->path);
+            err = "Wrong number of values";
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    return err;
+}
+
+/* Trigger of /Recipe/Stage */
+static int recipe_stage(
+        const struct pdvariable* variable,
+        void *dst, const void* src, size_t len,
+        struct timespec* time,
+        void* priv_data)
+{
+    char name[RECIPE_NAME_MAX + 1];
+    struct param_shadow *p;
+    const char *err;
+    (void)variable;
+    (void)priv_data;
+
+    memcpy(name, src, len);
+    name[len] = '\0';
+
+#ifdef VARIABLE_LOCKING
+    pthread_mutex_lock(&shadows.lock);
+#endif
+
+    recipe_differences = 0;
+    if (!(err = recipe_load(name))) {
+        for (p = shadows.list; p; p = p->next) {
+            if (!memcmp(recipe_image + p->offset, p->data, p->size))
+                continue;
+
+            syslog(LOG_INFO, "Recipe %s: %s differs", name, p->path);
+            recipe_differences++;
+        }
+        strcpy(recipe_staged, name);
+    }
+    else
+        recipe_staged[0] = '\0';
+
+#ifdef VARIABLE_LOCKING
+    pthread_mutex_unlock(&shadows.lock);
+#endif
+
+    if (err) {
+        syslog(LOG_ERR, "Staging recipe %s failed: %s", name, err);
+        return -EINVAL;
+    }
+
+    syslog(LOG_INFO, "Recipe %s staged, %u parameters differ",
+            name, recipe_differences);
+
+    memcpy(dst, src, len);
+    clock_gettime(CLOCK_REALTIME, time);
+
+    return 0;
+}
+
+/* Trigger of /Recipe/Activate */
+static int recipe_activate(
+        const struct pdvariable* variable,
+        void *dst, const void* src, size_t len,
+        struct timespec* time,
+        void* priv_data)
+{
+    struct param_shadow *p;
+    (void)variable;
     (void)priv_data;
 
-    write_parameter_lock(1, NULL);
-    memcpy(dst, src, len);
-    write_parameter_lock(0, NULL);
+    if (!recipe_staged[0]) {
+        syslog(LOG_ERR, "No recipe staged");
+        return -EINVAL;
+    }
+
+#ifdef VARIABLE_LOCKING
+    shadow_write_lock(&shadows, 1);
+#endif
+
+    for (p = shadows.list; p; p = p->next)
+        memcpy(p->data, recipe_image + p->offset, p->size);
+    recipe_differences = 0;
+
+#ifdef VARIABLE_LOCKING
+    shadow_write_lock(&shadows, 0);
+#endif
+
+    syslog(LOG_INFO, "Recipe %s activated", recipe_staged);
 
+    memcpy(dst, src, len);
     clock_gettime(CLOCK_REALTIME, time);
 
     return 0;
 }
 
-/****************************************************************************/
-
-int read_signal(
-        const struct pdvariable* signal,
-        void* dst, const void* src, size_t len,
-        struct timespec* time,
-        void* priv_data)
+/* Register the recipe variables, after all parameters */
+static const char *recipe_init(struct pdserv *m_pdserv, struct pdtask *pdtask)
 {
-    (void)signal;
-    struct thread_task* task = priv_data;
+    if (!recipe_dir)
+        return NULL;
 
-    read_signal_lock(1, &task->signal_lock);
-    memcpy(dst, src, len);
-    if (time)
-        *time = task->world_time;
-    read_signal_lock(0, &task->signal_lock);
+    if (!(recipe_image = malloc(shadows.size + 1)))
+        return "No memory for recipes.";
 
-    return 0;
+    if (!pdserv_parameter(m_pdserv, "/Recipe/Stage", 0666, pd_uint8_T,
+                recipe_name, RECIPE_NAME_MAX, NULL, recipe_stage, NULL)
+            || !pdserv_parameter(m_pdserv, "/Recipe/Activate", 0666,
+                pd_uint32_T, &recipe_activation, 1, NULL,
+                recipe_activate, NULL)
+            || !pdserv_signal(pdtask, 1, "/Recipe/Differences",
+                pd_uint32_T, &recipe_differences, 1, NULL))
+        return "Failed to register recipe variables.";
+
+    return NULL;
 }
-#endif
 
 /****************************************************************************
  * Create dimension array, taking care of Matlab's quirks:
@@ -1005,6 +2540,8 @@ register_parameter(
             rtwCAPI_GetDataIsComplex(dTypeMap, dataTypeIndex));
 
     const char* err = 0;
+    size_t size = rtwCAPI_GetDataTypeSize(dTypeMap, dataTypeIndex);
+    uint8_T i;
 
     /* Only allow built-in data types */
     if (!data_type)
@@ -1024,6 +2561,13 @@ register_parameter(
 
     snprintf(path, pathLen, "%s/%s", blockPath, paramName);
 
+    for (i = 0; i < ndim; ++i)
+        size *= dim[i];
+    if (!(address = shadow_parameter(address, size, path, data_type))) {
+        err = "No memory for shadow parameter.";
+        goto out;
+    }
+
 #ifdef VARIABLE_LOCKING
     pdserv_parameter(m_pdserv, path, 0666, data_type, address, ndim, dim,
             write_parameter, 0);
@@ -1079,6 +2623,8 @@ register_model_parameter(
             rtwCAPI_GetDataIsComplex(dTypeMap, dataTypeIndex));
 
     const char* err = 0;
+    size_t size = rtwCAPI_GetDataTypeSize(dTypeMap, dataTypeIndex);
+    uint8_T i;
 
     /* Only allow built-in data types */
     if (!data_type)
@@ -1092,6 +2638,13 @@ register_model_parameter(
 
     snprintf(path, pathLen, "/%s/%s", prefix, paramName);
 
+    for (i = 0; i < ndim; ++i)
+        size *= dim[i];
+    if (!(address = shadow_parameter(address, size, path, data_type))) {
+        err = "No memory for shadow parameter.";
+        goto out;
+    }
+
 #ifdef VARIABLE_LOCKING
     pdserv_parameter(m_pdserv, path, 0666, data_type, address, ndim, dim,
             write_parameter, 0);
@@ -1186,6 +2739,81 @@ const char *init_application(void)
 
 /****************************************************************************/
 
+/* Hot restart (option --restart): after a task stopped with an error, the
+ * model is terminated and initialized again in place, and the tasks start
+ * over a few cycles later. PdServ keeps running with its connections and
+ * the tuned parameters. The EtherCAT support layer keeps its masters
+ * active and only rebinds the PDOs, see ecs_start_slaves(), so that the
+ * slaves stay in OP.
+ */
+#define RESTART_MARGIN  2000000 /* Minimum time until the first cycle [ns] */
+
+static uint32_t restarts;       /* /Taskinfo/Restarts */
+
+static const char *restart_init(void)
+{
+    if (restart_max && !pdserv_signal(task[0].pdtask, 1,
+                "/Taskinfo/Restarts", pd_uint32_T, &restarts, 1, NULL))
+        return "Failed to register restart counter.";
+
+    return NULL;
+}
+
+/* Restart the model and set the start time of the tasks on the schedule
+ * of task 0. Returns an error message or NULL */
+static const char *restart_application(void)
+{
+    struct thread_task *p_task;
+    struct sched_param param;
+    struct timespec now;
+    uint64_t dt = 1.0e9 * task[0].sample_time + 0.5, t, start;
+    const char *err;
+    int policy;
+
+    restarts++;
+    syslog(LOG_INFO, "Restarting the model (%u of %u).",
+            restarts, restart_max);
+
+    /* A thread with SCHED_DEADLINE cannot create threads. The tasks apply
+     * their budget again in their first cycle */
+    if (sched_policy[task->sched_policy] == SCHED_DEADLINE) {
+        task_scheduler(task, &policy, &param);
+        sched_setscheduler(0, policy, &param);
+    }
+
+    for (p_task = task; p_task != task + NUMTASKS; ++p_task) {
+        if (p_task->deadline.state == DEADLINE_ACTIVE)
+            p_task->deadline.state = DEADLINE_MEASURE;
+        p_task->degrade = 0;
+        p_task->on_time = 0;
+        p_task->overrun.consecutive = 0;
+        p_task->chain.idle = 0;         /* Until it waits, see chain_join() */
+    }
+
+    /* The error status of the model stopped the tasks. It is not reset
+     * by the model, and init_application() would fail on it */
+    MdlTerminate();
+    rtmSetErrorStatus(RTM, NULL);
+    if ((err = init_application()))
+        return err;
+
+    /* The next cycle of task 0 at least RESTART_MARGIN from now. In
+     * virtual time, the clock just goes on */
+    t = TIMESPEC_TO_NS(task[0].monotonic_time);
+    if (!virtual_time) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        start = TIMESPEC_TO_NS(now) + RESTART_MARGIN;
+        if (t < start)
+            t += (start - t + dt - 1) / dt * dt;
+    }
+    task[NUMTASKS-1].monotonic_time.tv_sec = t / NSEC_PER_SEC;
+    task[NUMTASKS-1].monotonic_time.tv_nsec = t % NSEC_PER_SEC;
+
+    return NULL;
+}
+
+/****************************************************************************/
+
 /** Return the current system time.
  *
  * This is a callback needed by pdserv.
@@ -1284,6 +2912,89 @@ void usage(FILE *f)
             "  --time-dilation  -D <fact>  Cyclic time dilation factor.\n"
             "       No other timings are affected. This is useful for very\n"
             "       fast running simulation tasks causing overruns.\n"
+            "  --ethercat       -e <OPT>   Set an EtherCAT option, may be\n"
+            "                              repeated. OPT is one of:\n"
+            "       workers[=CPU,...]  One I/O thread per master of the\n"
+            "                          base task, the n-th CPU listed for\n"
+            "                          master n.\n"
+            "       synchronous[=MASTER,...]\n"
+            "       pipelined[=MASTER,...]\n"
+            "       turnaround[=MASTER,...]\n"
+            "                          I/O mode of the masters listed,\n"
+            "                          default all masters.\n"
+            "       release=US         Send synchronous outputs US after\n"
+            "                          the start of the cycle.\n"
+            "       turnaround-deadline=US\n"
+            "                          Time to poll for returning frames.\n"
+            "                          Default: half the period.\n"
+            "       bus-clock[=MASTER] Lock the tasks to the reference clock\n"
+            "                          of MASTER, default 0.\n"
+            "       calibrate=N        Measure N cycles and report the\n"
+            "                          smallest safe SYNC0 shift time.\n"
+            "                          Busy polls for the frames meanwhile.\n"
+            "       calibrate-margin=US\n"
+            "                          Margin added to the shift time.\n"
+            "  --shadow-parameters -s      Write parameters to a shadow\n"
+            "       copy, published at the start of a cycle where no task\n"
+            "       computes. The tasks take no parameter lock and do not\n"
+            "       wait for the writer.\n"
+            "  --recipes        -r <DIR>   Parameter recipes in DIR, staged\n"
+            "       with /Recipe/Stage and switched with /Recipe/Activate.\n"
+            "       Implies --shadow-parameters.\n"
+            "  --overrun        -o <POLICY>[=TID,...]\n"
+            "       Overrun policy of the tasks listed, default all tasks:\n"
+            "       catchup (default), skip, degrade or terminate after\n"
+            "       %d consecutive overruns. May be repeated.\n"
+            "  --wait           -w <STRATEGY>[=TID,...]\n"
+            "       Wait strategy of the tasks listed, default all tasks:\n"
+            "       sleep (default), spin (sleep, then spin for an adaptive\n"
+            "       margin before the start of the cycle) or poll (spin\n"
+            "       only, for a task with a CPU of its own). May be\n"
+            "       repeated.\n"
+            "  --scheduler      -S [TID,...:]<POLICY>[,PRIO]\n"
+            "       Scheduling of the tasks listed, default all tasks:\n"
+            "       fifo, rr, other or deadline. Default: fifo with the\n"
+            "       priority of --priority less the task id. For deadline,\n"
+            "       PRIO is the runtime budget in us per sample time,\n"
+            "       default: measured over the first %d cycles. May be\n"
+            "       repeated.\n"
+            "  --affinity       -a [TID,...:]<CPU,...>\n"
+            "       Pin the tasks listed, default all tasks, to the CPUs\n"
+            "       listed, e.g. 2-3,6. May be repeated.\n"
+            "  --housekeeping   -k <CPU,...>  Run the threads of PdServ\n"
+            "       on the CPUs listed.\n"
+            "  --cpu-latency    -l <US>    Wakeup latency of the CPUs\n"
+            "       requested via /dev/cpu_dma_latency while running.\n"
+            "       Default: 0. Negative: no request.\n"
+            "  --config         -C <PATH>  Read options from PATH, one\n"
+            "       long option without -- per line, e.g. affinity 1:3\n"
+            "  --chained        -t         Task 0 releases the other\n"
+            "       tasks after its step when they are due, instead of\n"
+            "       a timer per task. Their wait strategy is ignored.\n"
+            "  --partition-cpus -P <CPU,...>  Run the partitions of\n"
+            "       Fork Join blocks on a worker pinned to every CPU\n"
+            "       listed. The workers spin, so these CPUs should\n"
+            "       be isolated and not run a task. With real time\n"
+            "       throttling on, they sleep half a period after a job.\n"
+            "  --trigger        -T <TRIGGER>  Step task 0 when triggered\n"
+            "       instead of on its clock, implies --chained. TRIGGER\n"
+            "       is fd:N, an inherited eventfd, or shm:NAME, a futex\n"
+            "       in the shared memory object NAME.\n"
+            "  --trigger-out    -O <TRIGGER>  Fire TRIGGER after every\n"
+            "       step of task 0.\n"
+            "  --trigger-timeout -W <US>   Fall back to the clock when\n"
+            "       no trigger came US after the due time. Default: 0,\n"
+            "       wait for the trigger forever.\n"
+            "  --histogram-shm  -H <NAME>  Export the latency histograms\n"
+            "       of the tasks in the shared memory object NAME.\n"
+            "       Fails if another running process owns NAME.\n"
+            "  --virtual-time   -V <SEC>   Run the tasks as fast as\n"
+            "       possible on a virtual clock, in the order of their\n"
+            "       ids, and stop after SEC seconds of model time. 0:\n"
+            "       no end. Implies --chained.\n"
+            "  --restart        -R <N>     Restart the model in place up\n"
+            "       to N times after an error of a task, keeping PdServ\n"
+            "       and the EtherCAT masters running. Default: 0.\n"
             "  --help           -h         Show this help.\n"
             "\n"
             "Model information:\n"
@@ -1293,6 +3004,8 @@ void usage(FILE *f)
             "\tDate: %s\n"
             "\tEtherLab version: %s\n",
             base_name,
+            OVERRUNMAX,
+            DEADLINE_CYCLES,
             QUOTE(MODEL),
             MODEL_VERSION,
             MODEL_GENERATOR,
@@ -1302,6 +3015,242 @@ void usage(FILE *f)
 
 /****************************************************************************/
 
+/** Set an option of tasks from "NAME[=TID,...]", default all tasks. The
+ * index of NAME in the NULL terminated list name is stored in the
+ * unsigned int at offset in struct thread_task. Returns nonzero on error.
+ */
+int set_task_option(const char *arg, const char **name, size_t offset)
+{
+    size_t len = strcspn(arg, "=");
+    unsigned int value, tid;
+    const char *s;
+    char *end;
+
+    for (value = 0; name[value]; value++) {
+        if (strlen(name[value]) == len && !strncmp(arg, name[value], len))
+            break;
+    }
+    if (!name[value])
+        return -1;
+
+    if (!arg[len]) {
+        for (tid = 0; tid < NUMTASKS; tid++)
+            *(unsigned int *)((char *)&task[tid] + offset) = value;
+        return 0;
+    }
+
+    for (s = arg + len + 1; ; s = end + 1) {
+        tid = strtoul(s, &end, 10);
+        if (end == s || tid >= NUMTASKS || (*end && *end != ','))
+            return -1;
+        *(unsigned int *)((char *)&task[tid] + offset) = value;
+        if (!*end)
+            return 0;
+    }
+}
+
+/****************************************************************************/
+
+/** Parse the prefix "TID,...:" of an option into selected, default all
+ * tasks. Returns the rest of the option or NULL on error.
+ */
+const char *select_tasks(const char *arg, bool *selected)
+{
+    const char *colon = strchr(arg, ':'), *s;
+    unsigned int tid;
+    char *end;
+
+    for (tid = 0; tid < NUMTASKS; tid++)
+        selected[tid] = !colon;
+
+    if (!colon)
+        return arg;
+
+    for (s = arg; ; s = end + 1) {
+        tid = strtoul(s, &end, 10);
+        if (end == s || tid >= NUMTASKS || (*end != ':' && *end != ','))
+            return NULL;
+        selected[tid] = true;
+        if (end == colon)
+            return colon + 1;
+    }
+}
+
+/** Parse a list of CPUs like "0,2-3". Returns nonzero on error.
+ */
+int parse_cpu_list(const char *s, cpu_set_t *cpus)
+{
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO(cpus);
+
+    for (;; s = end + 1) {
+        first = last = strtoul(s, &end, 10);
+        if (end == s)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtoul(s, &end, 10);
+            if (end == s)
+                return -1;
+        }
+        if (first > last || last >= CPU_SETSIZE)
+            return -1;
+
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+
+        if (!*end)
+            return 0;
+        if (*end != ',')
+            return -1;
+    }
+}
+
+/** Set the scheduling of tasks from "[TID,...:]POLICY[,PRIORITY]".
+ * Returns nonzero on error.
+ */
+int set_task_scheduler(const char *arg)
+{
+    bool selected[NUMTASKS];
+    unsigned int policy, tid;
+    int prio = 0;
+    size_t len;
+    char *end;
+
+    if (!(arg = select_tasks(arg, selected)))
+        return -1;
+
+    len = strcspn(arg, ",");
+    for (policy = 0; sched_policy_name[policy]; policy++) {
+        if (strlen(sched_policy_name[policy]) == len
+                && !strncmp(arg, sched_policy_name[policy], len))
+            break;
+    }
+    if (!sched_policy_name[policy])
+        return -1;
+
+    /* The budget of SCHED_DEADLINE in us */
+    if (arg[len] && sched_policy[policy] == SCHED_DEADLINE) {
+        prio = strtol(arg + len + 1, &end, 10);
+        if (end == arg + len + 1 || *end || prio <= 0 || prio > 4000000)
+            return -1;
+    }
+    else if (arg[len]) {
+        prio = strtol(arg + len + 1, &end, 10);
+        if (end == arg + len + 1 || *end
+                || prio < sched_get_priority_min(sched_policy[policy])
+                || prio > sched_get_priority_max(sched_policy[policy]))
+            return -1;
+    }
+
+    for (tid = 0; tid < NUMTASKS; tid++) {
+        if (!selected[tid])
+            continue;
+
+        task[tid].sched_policy = policy;
+        if (sched_policy[policy] == SCHED_DEADLINE)
+            task[tid].deadline.runtime = 1000U * prio;
+        else
+            task[tid].sched_priority = prio;
+    }
+
+    return 0;
+}
+
+/** Set the CPU affinity of tasks from "[TID,...:]CPU,...". Returns nonzero
+ * on error.
+ */
+int set_task_affinity(const char *arg)
+{
+    bool selected[NUMTASKS];
+    unsigned int tid;
+    cpu_set_t cpus;
+
+    if (!(arg = select_tasks(arg, selected)) || parse_cpu_list(arg, &cpus))
+        return -1;
+
+    for (tid = 0; tid < NUMTASKS; tid++) {
+        if (selected[tid])
+            task[tid].cpus = cpus;
+    }
+
+    return 0;
+}
+
+/** Replace "--config PATH" (or -C PATH) on the command line with the
+ * options in PATH: one long option per line without the leading "--",
+ * the value separated by "=" or blanks. Empty lines and lines starting
+ * with "#" are ignored.
+ */
+void read_config(int *argc, char ***argv)
+{
+    char **arg = *argv, **args = NULL, *line = NULL, *s, *v;
+    const char *path;
+    size_t len = 0;
+    int i, n = 0;
+    FILE *f;
+
+    for (i = 0; i < *argc; i++) {
+        path = NULL;
+        if (!strcmp(arg[i], "--config") || !strcmp(arg[i], "-C")) {
+            if (i + 1 == *argc) {
+                fprintf(stderr, "%s needs a file name\n", arg[i]);
+                exit(1);
+            }
+            path = arg[++i];
+        }
+        else if (!strncmp(arg[i], "--config=", 9))
+            path = arg[i] + 9;
+
+        if (!path) {
+            if (!(args = realloc(args, (n + 2) * sizeof(*args))))
+                goto nomem;
+            args[n++] = arg[i];
+            continue;
+        }
+
+        if (!(f = fopen(path, "r"))) {
+            fprintf(stderr, "Could not open %s: %s\n",
+                    path, strerror(errno));
+            exit(1);
+        }
+
+        while (getline(&line, &len, f) != -1) {
+            s = line + strspn(line, " \t");
+            s[strcspn(s, "\r\n")] = '\0';
+            if (!*s || *s == '#')
+                continue;
+
+            v = s + strcspn(s, "= \t");
+            if (*v) {
+                *v++ = '\0';
+                v += strspn(v, "= \t");
+            }
+
+            args = realloc(args, (n + 2) * sizeof(*args));
+            if (!args || asprintf(&args[n++],
+                        *v ? "--%s=%s" : "--%s", s, v) < 0)
+                goto nomem;
+        }
+
+        fclose(f);
+    }
+
+    free(line);
+    args[n] = NULL;
+    *argc = n;
+    *argv = args;
+    return;
+
+nomem:
+    fprintf(stderr, "No memory for the options\n");
+    exit(1);
+}
+
+/****************************************************************************/
+
 /** Get the command-line options.
  */
 void get_options(int argc, char **argv)
@@ -1315,13 +3264,34 @@ void get_options(int argc, char **argv)
         {"pid-file",      required_argument, NULL, 'i'},
         {"start-phase",   required_argument, NULL, 'f'},
         {"time-dilation", required_argument, NULL, 'D'},
+        {"ethercat",      required_argument, NULL, 'e'},
+        {"shadow-parameters", no_argument,   NULL, 's'},
+        {"recipes",       required_argument, NULL, 'r'},
+        {"overrun",       required_argument, NULL, 'o'},
+        {"wait",          required_argument, NULL, 'w'},
+        {"scheduler",     required_argument, NULL, 'S'},
+        {"affinity",      required_argument, NULL, 'a'},
+        {"housekeeping",  required_argument, NULL, 'k'},
+        {"cpu-latency",   required_argument, NULL, 'l'},
+        {"chained",       no_argument,       NULL, 't'},
+        {"partition-cpus", required_argument, NULL, 'P'},
+        {"trigger",       required_argument, NULL, 'T'},
+        {"trigger-out",   required_argument, NULL, 'O'},
+        {"trigger-timeout", required_argument, NULL, 'W'},
+        {"histogram-shm", required_argument, NULL, 'H'},
+        {"virtual-time",  required_argument, NULL, 'V'},
+        {"restart",       required_argument, NULL, 'R'},
         {"daemon",        no_argument,       NULL, 'd'},
         {"help",          no_argument,       NULL, 'h'},
         {NULL,            no_argument,       NULL,   0}
     };
 
+    read_config(&argc, &argv);
+
     do {
-        c = getopt_long(argc, argv, "p:c:i:f:D:dh", longOptions, NULL);
+        c = getopt_long(argc, argv,
+                "p:c:i:f:D:e:sr:o:w:S:a:k:l:tP:T:O:W:H:V:R:dh",
+                longOptions, NULL);
 
         switch (c) {
             case 'p':
@@ -1361,6 +3331,110 @@ void get_options(int argc, char **argv)
                 }
                 break;
 
+            case 'e':
+                {
+                    const char *err = ecs_set_option
+                        ? ecs_set_option(optarg)
+                        : "Model does not use EtherCAT";
+                    if (err) {
+                        fprintf(stderr, "EtherCAT: %s\n", err);
+                        exit(1);
+                    }
+                }
+                break;
+
+            case 's':
+                shadow_parameters = true;
+                break;
+
+            case 'r':
+                recipe_dir = optarg;
+                shadow_parameters = true;
+                break;
+
+            case 'o':
+                if (set_task_option(optarg, overrun_policy_name,
+                            offsetof(struct thread_task, overrun_policy))) {
+                    fprintf(stderr, "Invalid overrun policy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'w':
+                if (set_task_option(optarg, wait_strategy_name,
+                            offsetof(struct thread_task, wait.strategy))) {
+                    fprintf(stderr, "Invalid wait strategy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'S':
+                if (set_task_scheduler(optarg)) {
+                    fprintf(stderr, "Invalid scheduler: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'a':
+                if (set_task_affinity(optarg)) {
+                    fprintf(stderr, "Invalid affinity: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'k':
+                if (parse_cpu_list(optarg, &housekeeping_cpus)) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'l':
+                cpu_latency = atoi(optarg);
+                break;
+
+            case 't':
+                chained = true;
+                break;
+
+            case 'P':
+                if (parse_cpu_list(optarg, &partition_cpus)) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'T':
+                trigger_in = optarg;
+                chained = true;
+                break;
+
+            case 'O':
+                trigger_out = optarg;
+                break;
+
+            case 'W':
+                trigger_timeout = atoi(optarg);
+                break;
+
+            case 'H':
+                histogram_shm = optarg;
+                break;
+
+            case 'V':
+                virtual_duration = atof(optarg);
+                if (virtual_duration < 0.0) {
+                    fprintf(stderr, "Invalid virtual time: %s\n", optarg);
+                    exit(1);
+                }
+                virtual_time = true;
+                chained = true;
+                break;
+
+            case 'R':
+                restart_max = atoi(optarg);
+                break;
+
             case 'd':
                 daemonize = true;
                 break;
@@ -1379,6 +3453,18 @@ void get_options(int argc, char **argv)
     }
     while (c != -1);
 
+#ifdef GET_PARAMETERS
+    if (shadow_parameters) {
+        fprintf(stderr, "Shadow parameters need PdServ 3.0 or newer\n");
+        exit(1);
+    }
+#endif
+
+    if (virtual_time && trigger_in) {
+        fprintf(stderr, "Virtual time and --trigger exclude each other\n");
+        exit(1);
+    }
+
     arg_count = argc - optind;
 
     if (arg_count) {
@@ -1397,7 +3483,12 @@ int main(int argc, char **argv)
     unsigned int running = 1;
     const char *err = NULL;
     struct thread_task* p_task;
+#ifdef SYSTEM_LOCKING
     pthread_rwlockattr_t rwlock_attr;
+#endif
+    struct timespec start_time, first_step;
+    bool failed;
+    int cpu_latency_fd = -1;
 #if !CLASSIC_INTERFACE
     const rtwCAPI_SampleTimeMap *sampleTimeMap
         = rtwCAPI_GetSampleTimeMapFromStaticMap(MdlGetCAPIStaticMap());
@@ -1408,6 +3499,9 @@ int main(int argc, char **argv)
 
     get_options(argc, argv);
 
+    if (sched_getaffinity(0, sizeof(default_cpus), &default_cpus))
+        CPU_ZERO(&default_cpus);
+
     if (daemonize) {
         int ret;
         fprintf(stderr, "Now becoming a daemon.\n");
@@ -1436,10 +3530,12 @@ int main(int argc, char **argv)
     /* Initialize model mapping info */
     MdlInitializeDataMapInfo();
 
+#ifdef SYSTEM_LOCKING
     /* Initialize rwlock attributes */
     pthread_rwlockattr_init(&rwlock_attr);
     pthread_rwlockattr_setkind_np(&rwlock_attr,
             PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
 
     pthread_key_create(&monotonic_time_key, 0);
 #if MT
@@ -1472,16 +3568,31 @@ int main(int argc, char **argv)
         p_task->sample_time = ts * dilation;
         p_task->pdtask = pdserv_create_task(pdserv, p_task->sample_time, 0);
 
-        pthread_rwlock_init(&p_task->signal_lock, &rwlock_attr);
         pthread_mutex_init(&p_task->param_lock, NULL);
+#ifdef SYSTEM_LOCKING
+        pthread_rwlock_init(&p_task->signal_lock, &rwlock_attr);
+#endif
+
+        if ((err = register_task_statistics(p_task))) {
+            pdserv_exit(pdserv);
+            goto out;
+        }
 
 #ifdef SYSTEM_LOCKING
         pdserv_set_signal_readlock_cb(
-                p_task->pdtask, read_signal_lock, &p_task->signal_lock);
+                p_task->pdtask, read_signal_lock, p_task);
 #endif
     }
 
+#ifdef SYSTEM_LOCKING
     pthread_rwlockattr_destroy(&rwlock_attr);
+#endif
+
+    if ((err = histogram_init(pdserv)) || (err = partition_init())
+            || (err = trigger_init()) || (err = restart_init())) {
+        pdserv_exit(pdserv);
+        goto out;
+    }
 
     /* Register signals and parameters */
     if ((err = rtw_capi_init(pdserv, task))) {
@@ -1494,6 +3605,23 @@ int main(int argc, char **argv)
         goto out;
     }
 
+    if (ecs_register_statistics
+            && (err = ecs_register_statistics(task[0].pdtask))) {
+        pdserv_exit(pdserv);
+        goto out;
+    }
+
+    if ((err = recipe_init(pdserv, task[0].pdtask))) {
+        pdserv_exit(pdserv);
+        goto out;
+    }
+
+    /* The threads of PdServ inherit the housekeeping CPUs */
+    if (CPU_COUNT(&housekeeping_cpus) && sched_setaffinity(0,
+                sizeof(housekeeping_cpus), &housekeeping_cpus))
+        fprintf(stderr, "Setting the housekeeping CPUs failed: %s\n",
+                strerror(errno));
+
     /* Prepare process-data interface, create threads, etc. */
     if (pdserv_prepare(pdserv)) {
         err = "Failed to start pdserv.";
@@ -1501,6 +3629,24 @@ int main(int argc, char **argv)
         goto out;
     }
 
+    if (priority == -1)
+        priority = sched_get_priority_max(SCHED_FIFO);
+
+    /* The EtherCAT workers are created by MdlStart(), before task 0 gets
+     * its scheduling below */
+    if (ecs_set_option) {
+        struct sched_param param;
+        char option[32];
+        int policy;
+
+        task_scheduler(task, &policy, &param);
+        if (policy != SCHED_OTHER) {
+            snprintf(option, sizeof(option), "worker-priority=%i",
+                    param.sched_priority);
+            ecs_set_option(option);
+        }
+    }
+
     /* Initialize model */
     if ((err = init_application())) {
         pdserv_exit(pdserv);
@@ -1511,21 +3657,41 @@ int main(int argc, char **argv)
     if (mlockall(MCL_CURRENT | MCL_FUTURE))
         fprintf(stderr, "mlockall() failed: %s\n", strerror(errno));
 
-    /* Set task priority. */
+    /* Set task priority and affinity of the first task. */
     {
         struct sched_param param;
-        if (priority == -1)
-            priority = sched_get_priority_max(SCHED_FIFO);
+        int policy;
 
-        param.sched_priority = priority;
-        if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+        task_scheduler(task, &policy, &param);
+        if (sched_setscheduler(0, policy, &param) == -1) {
             fprintf(stderr,
-                    "Setting SCHED_FIFO with priority %i failed: %s\n",
+                    "Setting scheduler %s with priority %i failed: %s\n",
+                    sched_policy_name[task->sched_policy],
                     param.sched_priority, strerror(errno));
 
             /* Reset priority, so that sub-threads start */
             priority = -1;
         }
+
+        if (CPU_COUNT(task_cpus(task)) && sched_setaffinity(0,
+                    sizeof(cpu_set_t), task_cpus(task)))
+            fprintf(stderr, "Setting the CPU affinity of task 0 failed: %s\n",
+                    strerror(errno));
+    }
+
+    /* Keep the CPUs out of deep idle states during cyclic operation */
+    if (cpu_latency >= 0 && !virtual_time) {
+        int32_t latency = cpu_latency;
+
+        cpu_latency_fd = open("/dev/cpu_dma_latency", O_WRONLY);
+        if (cpu_latency_fd == -1 || write(cpu_latency_fd,
+                    &latency, sizeof(latency)) != sizeof(latency)) {
+            fprintf(stderr, "Requesting a CPU latency of %i us failed: %s\n",
+                    cpu_latency, strerror(errno));
+            if (cpu_latency_fd != -1)
+                close(cpu_latency_fd);
+            cpu_latency_fd = -1;
+        }
     }
 
     /* Provoke the first stack fault before cyclic operation. */
@@ -1555,6 +3721,15 @@ int main(int argc, char **argv)
         timeradd(&p_task->monotonic_time, phase_shift);
     }
 
+    partition_start();
+
+    if (virtual_time)
+        virtual_start(&task[NUMTASKS-1].monotonic_time);
+
+    first_step = task[NUMTASKS-1].monotonic_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+start:
     /* Start sub-threads */
     for (p_task = task; p_task != task + NUMTASKS; ++p_task) {
         p_task->monotonic_time = task[NUMTASKS-1].monotonic_time;
@@ -1571,44 +3746,86 @@ int main(int argc, char **argv)
             p_task->rt_OneStep = rt_OneStepMain;
 #if MT
         else {
-            struct sched_param param = {
-                .sched_priority = priority - (p_task - task),
-            };
+            struct sched_param param;
             pthread_attr_t attr;
+            int policy;
 
-            /* Setup scheduler */
+            /* Setup scheduler and affinity before the thread runs */
             pthread_attr_init(&attr);
-            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
-            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-            pthread_attr_setschedparam(&attr, &param);
+            if (priority != -1) {
+                task_scheduler(p_task, &policy, &param);
+                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+                pthread_attr_setschedpolicy(&attr, policy);
+                pthread_attr_setschedparam(&attr, &param);
+            }
+            if (CPU_COUNT(task_cpus(p_task)))
+                pthread_attr_setaffinity_np(&attr,
+                        sizeof(cpu_set_t), task_cpus(p_task));
 
             p_task->rt_OneStep = rt_OneStepTid;
-            pthread_create(&p_task->thread,
-                    priority == -1 ? NULL : &attr, run_task, p_task);
+            pthread_create(&p_task->thread, &attr, run_task, p_task);
 
             pthread_attr_destroy(&attr);
         }
 #endif
     }
 
+    /* Rounding of the sample times of the tasks */
+    shadows.tolerance = 0.5e9 * task[0].sample_time;
+
     syslog(LOG_INFO, "Starting main thread.");
 
     /* Now run main task */
     run_task(&task[0]);
 
+    /* Let the chained tasks see that the application stops */
+    if (chained) {
+        for (p_task = task + 1; p_task != task + NUMTASKS; ++p_task)
+            chain_release(p_task);
+    }
+
     /* Collect tasks and report errors */
+    failed = false;
     for (p_task = task; p_task != task + NUMTASKS; ++p_task) {
         if (p_task != task)
             pthread_join(p_task->thread, 0);
 
-        if (p_task->err)
+        if (p_task->err) {
             fprintf(stderr, "Task %zi had an error: %s\n",
                     p_task - task, p_task->err);
+            failed = true;
+        }
+    }
+
+    if (failed && restarts < restart_max) {
+        if (!(err = restart_application())) {
+            running = 1;
+            goto start;
+        }
+        syslog(LOG_ERR, "Restarting the model failed: %s", err);
+    }
+
+    if (virtual_time) {
+        struct timespec end_time;
+        double model_time, real_time;
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        model_time = 1.0e-9 * DIFF_NS(first_step, task[0].monotonic_time);
+        real_time = 1.0e-9 * DIFF_NS(start_time, end_time);
+        fprintf(stderr, "Ran %.0f steps of task 0 (%.3f s of model time)"
+                " in %.3f s: %.0f steps/s, %.1f times real time\n",
+                model_time / task[0].sample_time + 0.5, model_time,
+                real_time, model_time / task[0].sample_time / real_time,
+                model_time / real_time);
     }
 
     /* Clean up */
+    partition_end();
+    if (cpu_latency_fd != -1)
+        close(cpu_latency_fd);
     pdserv_exit(pdserv);
-    MdlTerminate();
+    if (!err)   /* else a restart failed and the model is down */
+        MdlTerminate();
     if (pidPath[0])
         remove_pid_file();
 
@@ -1618,6 +3835,8 @@ int main(int argc, char **argv)
 #endif
 
 out:
+    histogram_exit();
+
     if (err) {
         fprintf(stderr, "Fatal error: %s\n", err);
         syslog(LOG_INFO, "Exiting with error.");